@@ -3,11 +3,92 @@
  * Handles both the new JSON format and legacy text lines gracefully.
  */
 
+/** perf_counters: one thread's counters over the stats interval; null where a counter can't be opened */
+export interface ThreadPerfCounters {
+  cycles: number | null;
+  instructions: number | null;
+  llc_misses: number | null;
+  /** Instructions per cycle, when both counters are available */
+  ipc?: number;
+  /** Last-level cache misses per 1000 instructions */
+  llc_mpki?: number;
+  ctx_switches?: { voluntary: number; involuntary: number };
+}
+
 export type CompositorEvent =
   | { event: "started"; stream_id: string; ts: number }
-  | { event: "srt_connected"; ts: number; resolution?: string }
-  | { event: "srt_dropped"; ts: number }
-  | { event: "stats"; ts: number; fps: number; srt_connected: boolean; audio_mode: string }
+  /** coalesced: repeats folded into this line while the source flapped */
+  | { event: "srt_connected"; ts: number; resolution?: string; coalesced?: number }
+  | { event: "srt_dropped"; ts: number; coalesced?: number }
+  | { event: "log_dropped"; ts: number; dropped: number; total: number }
+  | { event: "perf_counters_unavailable"; ts: number; thread: string; opened: number; message: string }
+  | {
+      event: "stats";
+      ts: number;
+      /** Frames actually encoded per second over the last interval */
+      fps: number;
+      target_fps?: number;
+      srt_connected: boolean;
+      audio_mode: string;
+      late_ticks?: number;
+      missed_ticks?: number;
+      /** Tick lateness histogram, keyed by bucket upper bound in µs ("inf" = overflow) */
+      tick_jitter_us?: Record<string, number>;
+      /** Busy time per tick over the last interval */
+      tick_us?: { p50: number; p90: number; p99: number; max: number };
+      /** Average µs per tick spent in each stage; mux is the writer thread's muxer time per tick */
+      stage_us?: {
+        bg_decode: number;
+        srt_copy: number;
+        video_encode: number;
+        audio_encode: number;
+        output: number;
+        mux: number;
+      };
+      /** Cumulative SRT video counters; dropped = decoded pictures overwritten before use */
+      srt?: { connects: number; received: number; decoded: number; dropped: number };
+      audio_fifo_ms?: { srt_shared: number; srt_local: number; bg: number };
+      /** Ticks re-sent without a new picture, by cause */
+      dup_ticks?: { srt: number; bg: number; late: number; governor?: number };
+      /** CPU overload governor state; load is the busy fraction of the frame period */
+      governor?: { level: number; name: string; load: number };
+      forced_idrs?: number;
+      /** Current encoder rate target when bg_video_bitrate is configured */
+      video_target_bps?: number;
+      /** Packets waiting for the FLV writer thread; peak_bytes is over the last interval */
+      out_queue?: {
+        pkts: number;
+        bytes: number;
+        peak_bytes: number;
+        dropped_video: number;
+        dropped_audio: number;
+      };
+      /** Encoder-to-pipe time of packets in the last interval */
+      mux_latency_us?: { mode: "interleaved" | "lowlatency"; avg: number; max: number };
+      /** Broadcast delay line, when delay_seconds or a runtime delay is set */
+      delay?: { seconds: number; target: number; buffered_pkts: number; buffered_bytes: number };
+      /** Instant-replay ring window, when replay_seconds is set */
+      replay?: { seconds: number; bytes: number; clips: number };
+      recording?: {
+        state: "ok" | "degraded" | "failed";
+        bytes: number;
+        queued_bytes: number;
+        dropped: number;
+      };
+      /** Per-thread hardware counters when perf_counters is set; srt appears once its thread runs */
+      perf?: { main: ThreadPerfCounters; srt?: ThreadPerfCounters };
+    }
+  | {
+      /** latency_probe: one marked SRT picture timed from sender to FLV muxer */
+      event: "probe";
+      ts: number;
+      pts: number;
+      sender_to_ingest_ms: number;
+      ingest_to_decode_ms: number;
+      decode_to_encode_ms: number;
+      encode_to_write_ms: number;
+      total_ms: number;
+    }
   | { event: "error"; ts: number; message: string }
   | { event: "stopped"; ts: number };
 
@@ -17,6 +17,7 @@ export interface StreamConfig {
   sampleRate: number;
   bgAudioFadeDelay: number;
   reconnectTimeout: number; // seconds, 0 = never auto-stop
+  governorMaxLevel?: number; // deepest CPU overload governor level, 0 = off
   twitchStreamKey: string;
   twitchIngestServer: string;
 }
@@ -39,6 +40,26 @@ const CONFIG_DIR = path.join(
   "configs"
 );
 
+const THUMB_DIR = path.join(
+  process.env.DATA_DIR ?? path.join(process.cwd(), "../../data"),
+  "thumbs"
+);
+
+const RUN_DIR = path.join(
+  process.env.DATA_DIR ?? path.join(process.cwd(), "../../data"),
+  "run"
+);
+
+/** Preview JPEG the compositor refreshes every few seconds while running */
+export function thumbnailPath(streamId: string): string {
+  return path.join(THUMB_DIR, `${streamId}.jpg`);
+}
+
+/** Unix socket serving the compositor's Prometheus metrics while running */
+export function metricsSocketPath(streamId: string): string {
+  return path.join(RUN_DIR, `${streamId}.metrics.sock`);
+}
+
 export class StreamProcess {
   readonly streamId: string;
   private compositor: ChildProcess | null = null;
@@ -71,6 +92,8 @@ export class StreamProcess {
     if (this.compositor) throw new Error("Stream already running");
 
     mkdirSync(CONFIG_DIR, { recursive: true });
+    mkdirSync(THUMB_DIR, { recursive: true });
+    mkdirSync(RUN_DIR, { recursive: true });
 
     // Write JSON config file for the compositor
     const compositorConfig = {
@@ -84,6 +107,9 @@ export class StreamProcess {
       audio_bitrate: config.audioBitrate,
       sample_rate: config.sampleRate,
       bg_unmute_delay: config.bgAudioFadeDelay,
+      thumb_path: thumbnailPath(config.streamId),
+      metrics_socket: metricsSocketPath(config.streamId),
+      governor_max_level: config.governorMaxLevel ?? 0,
     };
     writeFileSync(this.configPath, JSON.stringify(compositorConfig, null, 2));
 
@@ -0,0 +1,325 @@
+/*
+ * encsweep - x264 speed/quality sweep over the compositor's encoder setup
+ *
+ * Usage: ./encsweep [--config config.json] --input <clip> [--frames N]
+ *                   [--presets a,b,..] [--tunes a,b,..] [--threads a,b,..]
+ *                   [--bitrates kbps,..] [--governor] [--json]
+ *
+ * Decodes the first N frames (default 150) of a reference clip through
+ * the background source path, scaled to the configured output size, and
+ * keeps them in memory. Each combination of preset, tune, thread count and
+ * bitrate is then encoded with open_video_encoder() — the compositor's own
+ * encoder setup, starting from the config's encoder profile — as fast as
+ * possible. Reported per combination:
+ *
+ *   fps          encoded frames per wall-clock second
+ *   cpu_per_s    process CPU seconds per second of output (cores needed live)
+ *   kbps         achieved bitrate
+ *   psnr_y/psnr  over the whole run (YUV weighted 4:1:1)
+ *   ssim_y       mean of 8x8 windows on a 4-pixel grid
+ *
+ * Quality is measured by decoding the packets and comparing against the
+ * in-memory source frames. A table goes to stdout, or with --json one JSON
+ * line per combination. Tune "none" means no tune. With --governor every
+ * combination is encoded a second time with the overload governor's
+ * fast_encoder options for its preset (column gov = 1), so the level's
+ * effect on encode time and quality can be checked; presets where the
+ * governor skips that level get no second row.
+ */
+
+#define SRT_COMPOSITOR_NO_MAIN
+#include "srt_compositor.c"
+
+#define SW_MAX_LIST 16
+
+typedef struct {
+    char  *item[SW_MAX_LIST];
+    int    count;
+} SwList;
+
+typedef struct {
+    double fps, cpu_per_s, kbps, psnr_y, psnr, ssim_y;
+} SwResult;
+
+/* ================================================================== */
+/*  Helpers                                                            */
+/* ================================================================== */
+
+static void sw_split(SwList *l, char *csv) {
+    l->count = 0;
+    for (char *save = NULL, *t = strtok_r(csv, ",", &save); t && l->count < SW_MAX_LIST;
+         t = strtok_r(NULL, ",", &save))
+        l->item[l->count++] = t;
+}
+
+static double sw_cpu_s(void) {
+    struct rusage u;
+    getrusage(RUSAGE_SELF, &u);
+    return u.ru_utime.tv_sec + u.ru_utime.tv_usec / 1e6 +
+           u.ru_stime.tv_sec + u.ru_stime.tv_usec / 1e6;
+}
+
+/* Sum of squared differences of one plane */
+static double sw_sse(const uint8_t *a, int als, const uint8_t *b, int bls, int w, int h) {
+    double sse = 0;
+    for (int y = 0; y < h; y++) {
+        const uint8_t *pa = a + (size_t)y * als, *pb = b + (size_t)y * bls;
+        int64_t row = 0;
+        for (int x = 0; x < w; x++) {
+            int d = pa[x] - pb[x];
+            row += d * d;
+        }
+        sse += row;
+    }
+    return sse;
+}
+
+/* Mean SSIM over 8x8 windows stepped by 4 */
+static double sw_ssim(const uint8_t *a, int als, const uint8_t *b, int bls, int w, int h) {
+    const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+    double sum = 0;
+    int64_t n = 0;
+    for (int y = 0; y + 8 <= h; y += 4) {
+        for (int x = 0; x + 8 <= w; x += 4) {
+            int64_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            for (int j = 0; j < 8; j++) {
+                const uint8_t *pa = a + (size_t)(y + j) * als + x;
+                const uint8_t *pb = b + (size_t)(y + j) * bls + x;
+                for (int i = 0; i < 8; i++) {
+                    sa += pa[i]; sb += pb[i];
+                    saa += pa[i] * pa[i]; sbb += pb[i] * pb[i]; sab += pa[i] * pb[i];
+                }
+            }
+            double ma = sa / 64.0, mb = sb / 64.0;
+            double va = saa / 64.0 - ma * ma, vb = sbb / 64.0 - mb * mb;
+            double cov = sab / 64.0 - ma * mb;
+            sum += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+                   ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            n++;
+        }
+    }
+    return n ? sum / n : 1.0;
+}
+
+/* ================================================================== */
+/*  Source                                                             */
+/* ================================================================== */
+
+/* Decode up to max video frames of g_cfg.bg_file at the output size */
+static int sw_load(AppState *app, AVFrame **frames, int max) {
+    if (open_background(app) < 0) return -1;
+    int n = 0, misses = 0;
+    AVFrame *f = av_frame_alloc();
+    while (f && n < max && misses < 1000) {
+        int r = read_bg_frame(&app->bg, f, app->bg_audio_fifo);
+        if (r < 0) break;
+        if (r == 1) {
+            frames[n++] = f;
+            f = av_frame_alloc();
+            misses = 0;
+        } else {
+            misses++;
+        }
+        av_audio_fifo_reset(app->bg_audio_fifo);
+    }
+    av_frame_free(&f);
+    close_source(&app->bg);
+    return n;
+}
+
+/* ================================================================== */
+/*  One combination                                                    */
+/* ================================================================== */
+
+static int sw_run(AVFormatContext *fmt, const char *x264_params, AVFrame **frames, int count,
+                  SwResult *res) {
+    OutputCtx o;
+    memset(&o, 0, sizeof(o));
+    o.fmt_ctx = fmt;
+    AVCodecContext *enc = open_video_encoder(&o, x264_params);
+    const AVCodec *dc = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecContext *dec = dc ? avcodec_alloc_context3(dc) : NULL;
+    AVPacket **pkts = av_calloc(count + 64, sizeof(*pkts));
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *out = av_frame_alloc();
+    int npkts = 0, ret = -1;
+    if (!enc || !dec || !pkts || !pkt || !out || avcodec_open2(dec, dc, NULL) < 0)
+        goto done;
+
+    /* ---- Encode: timed, nothing else running ---- */
+    double cpu0 = sw_cpu_s();
+    int64_t t0 = av_gettime_relative();
+    int64_t bytes = 0;
+    for (int i = 0; i <= count; i++) {
+        AVFrame *f = i < count ? frames[i] : NULL;   /* NULL flushes */
+        if (f) {
+            f->pts = i;
+            f->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+        if (avcodec_send_frame(enc, f) < 0) goto done;
+        while (avcodec_receive_packet(enc, pkt) >= 0) {
+            bytes += pkt->size;
+            if (npkts < count + 64) pkts[npkts++] = av_packet_clone(pkt);
+            av_packet_unref(pkt);
+        }
+    }
+    double wall = (av_gettime_relative() - t0) / 1e6;
+    double cpu  = sw_cpu_s() - cpu0;
+    double out_s = count / av_q2d(g_cfg.out_rate);
+
+    /* ---- Decode and compare, in order (no B-frames) ---- */
+    double sse[3] = {0}, ssim = 0;
+    int decoded = 0, w = g_cfg.out_width, h = g_cfg.out_height;
+    for (int i = 0; i <= npkts && decoded < count; i++) {
+        if (avcodec_send_packet(dec, i < npkts ? pkts[i] : NULL) < 0) break;
+        while (decoded < count && avcodec_receive_frame(dec, out) >= 0) {
+            const AVFrame *src = frames[decoded++];
+            for (int p = 0; p < 3; p++)
+                sse[p] += sw_sse(src->data[p], src->linesize[p], out->data[p], out->linesize[p],
+                                 p ? w / 2 : w, p ? h / 2 : h);
+            ssim += sw_ssim(src->data[0], src->linesize[0], out->data[0], out->linesize[0], w, h);
+            av_frame_unref(out);
+        }
+    }
+    if (!decoded) goto done;
+
+    double px = (double)w * h * decoded, cpx = (double)(w / 2) * (h / 2) * decoded;
+    double mse_y = sse[0] / px;
+    double mse   = (sse[0] + sse[1] + sse[2]) / (px + 2 * cpx);
+    res->fps       = wall > 0 ? count / wall : 0;
+    res->cpu_per_s = cpu / out_s;
+    res->kbps      = bytes * 8 / out_s / 1000;
+    res->psnr_y    = mse_y > 0 ? 10 * log10(255.0 * 255.0 / mse_y) : 99.0;
+    res->psnr      = mse   > 0 ? 10 * log10(255.0 * 255.0 / mse)   : 99.0;
+    res->ssim_y    = ssim / decoded;
+    ret = 0;
+
+done:
+    for (int i = 0; i < npkts; i++) av_packet_free(&pkts[i]);
+    av_free(pkts);
+    av_packet_free(&pkt);
+    av_frame_free(&out);
+    avcodec_free_context(&enc);
+    avcodec_free_context(&dec);
+    return ret;
+}
+
+/* ================================================================== */
+/*  main                                                               */
+/* ================================================================== */
+
+int main(int argc, char **argv) {
+    const char *config_path = NULL, *input = NULL;
+    char presets[256] = "ultrafast,superfast,veryfast", tunes[256] = "zerolatency",
+         threads[256] = "", bitrates[256] = "";
+    int max_frames = 150, json = 0, gov = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if      (!strcmp(argv[i], "--config")   && v) { config_path = v; i++; }
+        else if (!strcmp(argv[i], "--input")    && v) { input = v; i++; }
+        else if (!strcmp(argv[i], "--frames")   && v) { max_frames = atoi(v); i++; }
+        else if (!strcmp(argv[i], "--presets")  && v) { snprintf(presets,  sizeof(presets),  "%s", v); i++; }
+        else if (!strcmp(argv[i], "--tunes")    && v) { snprintf(tunes,    sizeof(tunes),    "%s", v); i++; }
+        else if (!strcmp(argv[i], "--threads")  && v) { snprintf(threads,  sizeof(threads),  "%s", v); i++; }
+        else if (!strcmp(argv[i], "--bitrates") && v) { snprintf(bitrates, sizeof(bitrates), "%s", v); i++; }
+        else if (!strcmp(argv[i], "--governor")) gov = 1;
+        else if (!strcmp(argv[i], "--json")) json = 1;
+        else input = NULL, i = argc;
+    }
+    if (!input || max_frames < 1) {
+        fprintf(stderr, "Usage: %s [--config config.json] --input <clip> [--frames N]\n"
+                        "          [--presets a,b] [--tunes a,b|none] [--threads a,b]\n"
+                        "          [--bitrates kbps,..] [--governor] [--json]\n", argv[0]);
+        return 1;
+    }
+
+    config_defaults();
+    if (config_path && load_config(config_path) < 0) return 1;
+    if (log_start() < 0) return 1;
+    EncoderProfile base = g_cfg.enc;
+    /* Lists default to the profile's own values */
+    if (!threads[0])  snprintf(threads, sizeof(threads), "%d", base.threads);
+    if (!bitrates[0]) snprintf(bitrates, sizeof(bitrates), "%d",
+                               (base.bitrate > 0 ? base.bitrate : g_cfg.video_bitrate) / 1000);
+    SwList lp, lt, lth, lb;
+    sw_split(&lp, presets);
+    sw_split(&lt, tunes);
+    sw_split(&lth, threads);
+    sw_split(&lb, bitrates);
+
+    AppState app;
+    memset(&app, 0, sizeof(app));
+    atomic_init(&app.sws_flags, SWS_BICUBIC);   /* reference quality, not speed */
+    app.bg_audio_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, g_cfg.out_channels,
+                                            g_cfg.sample_rate * 2);
+    snprintf(g_cfg.bg_file, sizeof(g_cfg.bg_file), "%s", input);
+    AVFrame **frames = av_calloc(max_frames, sizeof(*frames));
+    int count = frames && app.bg_audio_fifo ? sw_load(&app, frames, max_frames) : -1;
+    if (count <= 0) {
+        fprintf(stderr, "encsweep: no video frames decoded from %s\n", input);
+        return 1;
+    }
+
+    AVFormatContext *fmt = NULL;   /* flags only (global header); never written */
+    if (avformat_alloc_output_context2(&fmt, NULL, "flv", NULL) < 0) return 1;
+
+    if (!json) {
+        printf("# %s: %d frames at %dx%d, %.3f fps, profile \"%s\" (%s)\n", input, count,
+               g_cfg.out_width, g_cfg.out_height, av_q2d(g_cfg.out_rate), base.name,
+               base.rc_mode == RC_CRF ? "crf" : base.rc_mode == RC_CBR ? "cbr" : "abr");
+        printf("%-10s %-12s %7s %9s %3s %9s %8s %9s %8s %8s %7s\n", "preset", "tune", "threads",
+               "kbps_set", "gov", "kbps", "fps", "cpu_per_s", "psnr_y", "psnr", "ssim_y");
+    }
+    int failed = 0;
+    for (int a = 0; a < lp.count; a++)
+    for (int b = 0; b < lt.count; b++)
+    for (int c = 0; c < lth.count; c++)
+    for (int d = 0; d < lb.count; d++)
+    for (int e = 0; e <= gov; e++) {
+        EncoderProfile p = base;
+        snprintf(p.preset, sizeof(p.preset), "%s", lp.item[a]);
+        snprintf(p.tune, sizeof(p.tune), "%s", strcmp(lt.item[b], "none") ? lt.item[b] : "");
+        p.threads = atoi(lth.item[c]);
+        int kbps = atoi(lb.item[d]);
+        p.bitrate = kbps * 1000;
+        if (p.rc_mode == RC_CBR)
+            p.maxrate = p.bufsize = p.bitrate;
+        char err[128];
+        SwResult r;
+        if (validate_encoder_profile(&p, err, sizeof(err)) < 0) {
+            fprintf(stderr, "encsweep: skipping %s/%s: %s\n", lp.item[a], lt.item[b], err);
+            failed = 1;
+            continue;
+        }
+        const char *x264_params = e ? governor_x264_params(p.preset) : NULL;
+        if (e && !x264_params)
+            continue;
+        g_cfg.enc = p;
+        if (sw_run(fmt, x264_params, frames, count, &r) < 0) {
+            fprintf(stderr, "encsweep: %s/%s/%d/%d%s failed\n",
+                    p.preset, lt.item[b], p.threads, kbps, e ? "/gov" : "");
+            failed = 1;
+            continue;
+        }
+        if (json)
+            printf("{\"encsweep\":{\"input\":\"%s\",\"resolution\":\"%dx%d\",\"frames\":%d,"
+                   "\"preset\":\"%s\",\"tune\":\"%s\",\"threads\":%d,\"kbps_set\":%d,"
+                   "\"gov\":%d,\"kbps\":%.0f,\"fps\":%.1f,\"cpu_per_s\":%.3f,\"psnr_y\":%.2f,"
+                   "\"psnr\":%.2f,\"ssim_y\":%.4f}}\n",
+                   input, g_cfg.out_width, g_cfg.out_height, count, p.preset, lt.item[b],
+                   p.threads, kbps, e, r.kbps, r.fps, r.cpu_per_s, r.psnr_y, r.psnr, r.ssim_y);
+        else
+            printf("%-10s %-12s %7d %9d %3d %9.0f %8.1f %9.3f %8.2f %8.2f %7.4f\n",
+                   p.preset, lt.item[b], p.threads, kbps, e, r.kbps, r.fps, r.cpu_per_s,
+                   r.psnr_y, r.psnr, r.ssim_y);
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < count; i++) av_frame_free(&frames[i]);
+    av_free(frames);
+    avformat_free_context(fmt);
+    av_audio_fifo_free(app.bg_audio_fifo);
+    log_shutdown();
+    return failed;
+}
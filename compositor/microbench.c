@@ -0,0 +1,318 @@
+/*
+ * microbench - per-frame kernels of srt_compositor, timed in isolation
+ *
+ * Usage: ./microbench [--seconds S] [--label TEXT] [--only KERNEL]
+ *
+ * Builds on srt_compositor.c itself (included with its main() left out),
+ * so the encoders, scaler flags and FIFO patterns are exactly the ones the
+ * compositor runs. Each kernel is measured at 720p30, 1080p30 and 1080p60
+ * and reported as one JSON line on stdout:
+ *
+ *   {"microbench":{"label":"…","arch":"aarch64","cpu":"…","mode":"1080p30",
+ *    "kernel":"x264_encode","calls":…,"median_us":…,"p90_us":…,
+ *    "min_us":…,"frame_budget_pct":…}}
+ *
+ * frame_budget_pct is the share of one frame interval the kernel takes at
+ * its per-frame call rate (audio frames run ~1.5x per video frame at 30 fps).
+ * Logs from the compositor code go to stderr as usual.
+ */
+
+#define SRT_COMPOSITOR_NO_MAIN
+#include "srt_compositor.c"
+
+#include <sys/utsname.h>
+
+#define MB_MAX_CALLS 100000
+
+typedef struct {
+    const char *name;
+    int         width, height, fps;
+} MbMode;
+
+static const MbMode mb_modes[] = {
+    { "720p30",  1280,  720, 30 },
+    { "1080p30", 1920, 1080, 30 },
+    { "1080p60", 1920, 1080, 60 },
+};
+
+/* State shared by the kernels of one mode */
+typedef struct {
+    AppState    app;
+    const MbMode *mode;
+    struct SwsContext *sws;
+    uint8_t    *src[4], *dst[4];
+    int         src_ls[4], dst_ls[4];
+    AVAudioFifo *shared_fifo;
+    AVFrame    *frame;          /* x264 input */
+    uint8_t    *noise;          /* texture panned across x264 input */
+    int64_t     n;              /* calls so far, drives the synthetic motion */
+    int         aframe_sz;
+    int         audio_rem;      /* sample_rate % fps carried between ticks */
+} MbCtx;
+
+typedef void (*MbKernel)(MbCtx *c);
+
+static double mb_seconds = 0.5;
+static const char *mb_label = "", *mb_only = NULL;
+static char mb_arch[64], mb_cpu[128];
+
+/* ================================================================== */
+/*  Harness                                                            */
+/* ================================================================== */
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void mb_host(void) {
+    struct utsname u;
+    snprintf(mb_arch, sizeof(mb_arch), "%s", uname(&u) == 0 ? u.machine : "unknown");
+    snprintf(mb_cpu, sizeof(mb_cpu), "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (!f) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        /* x86: "model name"; ARM: "Model" (Pi) or "Hardware" */
+        if (strncmp(line, "model name", 10) && strncmp(line, "Model", 5) &&
+            strncmp(line, "Hardware", 8))
+            continue;
+        char *v = strchr(line, ':');
+        if (!v) continue;
+        v += strspn(v + 1, " \t") + 1;
+        v[strcspn(v, "\n\"\\")] = '\0';
+        snprintf(mb_cpu, sizeof(mb_cpu), "%s", v);
+        break;
+    }
+    fclose(f);
+}
+
+/* Time single calls until mb_seconds have passed; setup (if any) runs
+ * before each call and is not counted */
+static void mb_run(MbCtx *c, const char *kernel, MbKernel setup, MbKernel fn,
+                   double calls_per_frame) {
+    if (mb_only && strcmp(mb_only, kernel) != 0) return;
+    static double us[MB_MAX_CALLS];
+    for (int i = 0; i < 5; i++) {     /* warm caches and encoder lookahead */
+        if (setup) setup(c);
+        fn(c);
+    }
+    int n = 0;
+    int64_t end = mono_ns() + (int64_t)(mb_seconds * 1e9);
+    while (n < MB_MAX_CALLS && (n < 10 || mono_ns() < end)) {
+        if (setup) setup(c);
+        int64_t t0 = mono_ns();
+        fn(c);
+        us[n++] = (mono_ns() - t0) / 1e3;
+    }
+    qsort(us, n, sizeof(us[0]), cmp_double);
+    double frame_us = 1e6 / c->mode->fps;
+    printf("{\"microbench\":{\"label\":\"%s\",\"arch\":\"%s\",\"cpu\":\"%s\",\"mode\":\"%s\","
+           "\"kernel\":\"%s\",\"calls\":%d,\"median_us\":%.2f,\"p90_us\":%.2f,"
+           "\"min_us\":%.2f,\"frame_budget_pct\":%.3f}}\n",
+           mb_label, mb_arch, mb_cpu, c->mode->name, kernel, n, us[n / 2], us[n * 9 / 10],
+           us[0], us[n / 2] * calls_per_frame / frame_us * 100);
+    fflush(stdout);
+}
+
+/* ================================================================== */
+/*  Kernels                                                            */
+/* ================================================================== */
+
+/* Source scaler as open_background/open_srt_source set it up: source
+ * picture → output size, yuv420p. src is always 1080p, the common
+ * camera size; at 1080p out this is a same-size pass. */
+static int mb_scaler(MbCtx *c, int flags) {
+    c->sws = sws_getCachedContext(c->sws, 1920, 1080, AV_PIX_FMT_YUV420P,
+                                  g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P,
+                                  flags, NULL, NULL, NULL);
+    return c->sws ? 0 : -1;
+}
+
+static void k_sws(MbCtx *c) {
+    sws_scale(c->sws, (const uint8_t *const *)c->src, c->src_ls, 0, 1080, c->dst, c->dst_ls);
+}
+
+/* SRT thread → SrtShared and SrtShared → out_frame are each one of these */
+static void k_image_copy(MbCtx *c) {
+    av_image_copy(c->app.shared.video_data, c->app.shared.video_linesize,
+                  (const uint8_t **)c->dst, c->dst_ls,
+                  AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
+}
+
+/* One tick of SRT audio as main_loop moves it: one frame interval of
+ * samples written into the shared FIFO in SRT-sized pieces of up to 1024,
+ * the locked drain into srt_local_fifo through a scratch buffer, and the
+ * encoder-sized reads */
+static void k_audio_fifo(MbCtx *c) {
+    SrtShared *sh = &c->app.shared;
+    int fps = c->mode->fps;
+    int tick = (g_cfg.sample_rate + c->audio_rem) / fps;
+    c->audio_rem = (g_cfg.sample_rate + c->audio_rem) % fps;
+    uint8_t *chunk[2] = {0};
+    av_samples_alloc(chunk, NULL, g_cfg.out_channels, 1024, AV_SAMPLE_FMT_FLTP, 0);
+    for (int done = 0; done < tick; done += 1024) {
+        int n = tick - done < 1024 ? tick - done : 1024;
+        pthread_mutex_lock(&sh->lock);
+        av_audio_fifo_write(sh->audio_fifo, (void **)chunk, n);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    av_freep(&chunk[0]);
+
+    pthread_mutex_lock(&sh->lock);
+    int avail = av_audio_fifo_size(sh->audio_fifo);
+    if (avail > 0) {
+        uint8_t *tbuf[8] = {0};
+        av_samples_alloc(tbuf, NULL, g_cfg.out_channels, avail, AV_SAMPLE_FMT_FLTP, 0);
+        av_audio_fifo_read(sh->audio_fifo, (void **)tbuf, avail);
+        av_audio_fifo_write(c->app.srt_local_fifo, (void **)tbuf, avail);
+        av_freep(&tbuf[0]);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    uint8_t *out[2] = {0};
+    av_samples_alloc(out, NULL, g_cfg.out_channels, c->aframe_sz, AV_SAMPLE_FMT_FLTP, 0);
+    while (av_audio_fifo_size(c->app.srt_local_fifo) >= c->aframe_sz)
+        av_audio_fifo_read(c->app.srt_local_fifo, (void **)out, c->aframe_sz);
+    av_freep(&out[0]);
+}
+
+static void k_audio_fill(MbCtx *c) {
+    uint8_t *buf[2] = {0};
+    av_samples_alloc(buf, NULL, g_cfg.out_channels, c->aframe_sz, AV_SAMPLE_FMT_FLTP, 0);
+    for (int ch = 0; ch < g_cfg.out_channels; ch++)
+        for (int i = 0; i < c->aframe_sz; i++)
+            ((float *)buf[ch])[i] = 0.25f * (float)sin((c->n * c->aframe_sz + i) * 0.0576);
+    av_audio_fifo_write(c->app.bg_audio_fifo, (void **)buf, c->aframe_sz);
+    av_freep(&buf[0]);
+    c->n++;
+}
+
+static void k_audio_encode(MbCtx *c) {
+    encode_one_audio_frame(&c->app, c->app.bg_audio_fifo, c->aframe_sz);
+}
+
+/* A panning texture over a moving gradient: enough detail and motion
+ * that x264 does real work, unlike a flat or static picture */
+static void k_video_fill(MbCtx *c) {
+    AVFrame *f = c->frame;
+    av_frame_make_writable(f);
+    int w = g_cfg.out_width, h = g_cfg.out_height;
+    int dx = (int)(c->n * 3 % w), dy = (int)(c->n % h);
+    for (int y = 0; y < h; y++) {
+        const uint8_t *nrow = c->noise + (size_t)((y + dy) % h) * w;
+        uint8_t *row = f->data[0] + (size_t)y * f->linesize[0];
+        for (int x = 0; x < w; x++)
+            row[x] = (uint8_t)(((x + y + 2 * c->n) & 0x7f) + (nrow[(x + dx) % w] >> 1));
+    }
+    for (int p = 1; p < 3; p++)
+        for (int y = 0; y < h / 2; y++)
+            memset(f->data[p] + (size_t)y * f->linesize[p], 128 + (int)(c->n % 32) - 16, w / 2);
+    c->n++;
+}
+
+static void k_video_encode(MbCtx *c) {
+    encode_write_video(&c->app.out, c->frame);
+}
+
+/* ================================================================== */
+/*  Per-mode setup                                                     */
+/* ================================================================== */
+
+static int mb_mode(const MbMode *m) {
+    MbCtx *c = calloc(1, sizeof(*c));
+    if (!c) return -1;
+    c->mode = m;
+    config_defaults();
+    g_cfg.out_width   = m->width;
+    g_cfg.out_height  = m->height;
+    g_cfg.out_fps     = m->fps;
+    g_cfg.out_rate    = (AVRational){ m->fps, 1 };
+    g_cfg.null_output = 1;
+
+    AppState *app = &c->app;
+    pthread_mutex_init(&app->shared.lock, NULL);
+    av_image_alloc(app->shared.video_data, app->shared.video_linesize,
+                   m->width, m->height, AV_PIX_FMT_YUV420P, 1);
+    app->shared.audio_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, g_cfg.out_channels,
+                                                 g_cfg.sample_rate * 2);
+    app->srt_local_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, g_cfg.out_channels,
+                                              g_cfg.sample_rate * 2);
+    app->bg_audio_fifo  = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, g_cfg.out_channels,
+                                              g_cfg.sample_rate * 2);
+    av_image_alloc(c->src, c->src_ls, 1920, 1080, AV_PIX_FMT_YUV420P, 32);
+    av_image_alloc(c->dst, c->dst_ls, m->width, m->height, AV_PIX_FMT_YUV420P, 32);
+    c->noise = malloc((size_t)m->width * m->height);
+    c->frame = av_frame_alloc();
+    if (!app->shared.video_data[0] || !app->shared.audio_fifo || !app->srt_local_fifo ||
+        !app->bg_audio_fifo || !c->src[0] || !c->dst[0] || !c->noise || !c->frame)
+        return -1;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < (size_t)m->width * m->height; i++) {
+        seed = seed * 1103515245 + 12345;
+        c->noise[i] = (uint8_t)(seed >> 24);
+    }
+    for (int i = 0; i < 1920 * 1080; i++)
+        c->src[0][i] = c->noise[i % ((size_t)m->width * m->height)];
+    memset(c->src[1], 128, (size_t)c->src_ls[1] * 540);
+    memset(c->src[2], 128, (size_t)c->src_ls[2] * 540);
+    c->frame->format = AV_PIX_FMT_YUV420P;
+    c->frame->width  = m->width;
+    c->frame->height = m->height;
+    if (av_frame_get_buffer(c->frame, 0) < 0 || open_output(app) < 0) {
+        fprintf(stderr, "microbench: cannot open encoders for %s\n", m->name);
+        return -1;
+    }
+    c->aframe_sz = app->out.audio_enc_ctx->frame_size > 0 ?
+                   app->out.audio_enc_ctx->frame_size : 1024;
+    double audio_per_frame = (double)g_cfg.sample_rate / c->aframe_sz / m->fps;
+
+    if (mb_scaler(c, SWS_BILINEAR) == 0)
+        mb_run(c, "sws_bilinear", NULL, k_sws, 1);
+    if (mb_scaler(c, SWS_FAST_BILINEAR) == 0)
+        mb_run(c, "sws_fast_bilinear", NULL, k_sws, 1);
+    mb_run(c, "image_copy", NULL, k_image_copy, 2);
+    mb_run(c, "audio_fifo_tick", NULL, k_audio_fifo, 1);
+    mb_run(c, "encode_one_audio_frame", k_audio_fill, k_audio_encode, audio_per_frame);
+    c->n = 0;
+    mb_run(c, "x264_encode", k_video_fill, k_video_encode, 1);
+
+    output_flush_tick(&app->out);
+    close_output(&app->out);
+    sws_freeContext(c->sws);
+    av_frame_free(&c->frame);
+    av_freep(&c->src[0]);
+    av_freep(&c->dst[0]);
+    av_freep(&app->shared.video_data[0]);
+    av_audio_fifo_free(app->shared.audio_fifo);
+    av_audio_fifo_free(app->srt_local_fifo);
+    av_audio_fifo_free(app->bg_audio_fifo);
+    pthread_mutex_destroy(&app->shared.lock);
+    free(c->noise);
+    free(c);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            mb_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+            mb_label = argv[++i];
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+            mb_only = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [--seconds S] [--label TEXT] [--only KERNEL]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (log_start() < 0) return 1;
+    mb_host();
+    signal(SIGPIPE, SIG_IGN);
+
+    int ret = 0;
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(mb_modes); i++)
+        if (mb_mode(&mb_modes[i]) < 0) ret = 1;
+    log_shutdown();
+    return ret;
+}
@@ -0,0 +1,168 @@
+#!/bin/bash
+# pgo.sh - Training and report steps of 'make pgo'
+#
+# Usage: ./pgo.sh train  <instrumented binary>
+#        ./pgo.sh report <baseline binary> <pgo binary>
+#
+# The workload is the compositor's own: --simulate on a scenario that
+# walks every switching path (connect, loss, timeout drop, reconnect,
+# close), then --bench on a synthetic TS so the SRT demux/decode/scale
+# path is covered too. report replays the same workload with both
+# binaries, prints best-of-PGO_RUNS wall time per workload and, when perf
+# is usable, per-function samples and speedup for the hottest functions.
+# Without perf it falls back to the per-stage times from --bench.
+#
+# Environment:
+#   PGO_CONFIG         compositor config to train with (output size, profile)
+#   PGO_BENCH_INPUT    TS file for --bench; generated with ffmpeg if unset
+#   PGO_BENCH_FRAMES   frames per --bench run (600)
+#   PGO_RUNS           timed runs per binary and workload (3)
+#   PGO_TOP            functions in the per-function table (15)
+
+set -e
+
+MODE="$1"
+BG_VIDEO="black.mp4"
+PGO_BENCH_FRAMES="${PGO_BENCH_FRAMES:-600}"
+PGO_RUNS="${PGO_RUNS:-3}"
+PGO_TOP="${PGO_TOP:-15}"
+WORK="${PGO_DIR:-pgo}"
+mkdir -p "${WORK}"
+
+if [ -n "${PGO_CONFIG}" ]; then
+    CONFIG="${PGO_CONFIG}"
+else
+    CONFIG="${WORK}/pgo.json"
+    cat > "${CONFIG}" <<JSON
+{
+  "srt_url": "srt://127.0.0.1:9730?mode=listener",
+  "bg_file": "${BG_VIDEO}",
+  "stream_id": "pgo"
+}
+JSON
+fi
+
+cat > "${WORK}/scenario.txt" <<SCENARIO
+1     connect
+15    loss 3
+25    loss 0
+30    drop
+38    connect loss=1
+50    close
+55    connect
+70    end
+SCENARIO
+
+# Synthetic camera-like input for --bench at the config's output size
+# (the compositor's 1280x720 default when the config doesn't set one)
+BENCH_INPUT="${PGO_BENCH_INPUT:-${WORK}/bench.ts}"
+if [ ! -f "${BENCH_INPUT}" ] && command -v ffmpeg > /dev/null; then
+    OW=$(grep -o '"out_width": *[0-9]*' "${CONFIG}" | grep -o '[0-9]*$' || echo 1280)
+    OH=$(grep -o '"out_height": *[0-9]*' "${CONFIG}" | grep -o '[0-9]*$' || echo 720)
+    ffmpeg -hide_banner -loglevel error -y \
+        -f lavfi -i "testsrc2=size=${OW}x${OH}:rate=30" \
+        -f lavfi -i "sine=frequency=440:sample_rate=48000" -t 20 \
+        -c:v libx264 -preset ultrafast -g 60 -c:a aac -f mpegts "${BENCH_INPUT}"
+fi
+if [ ! -f "${BENCH_INPUT}" ]; then
+    echo "pgo: no PGO_BENCH_INPUT and no ffmpeg to make one, --bench workload skipped" >&2
+    BENCH_INPUT=""
+fi
+
+# run <workload> <command...> — one workload, JSON result on stdout
+run() {
+    local w="$1"
+    shift
+    case "${w}" in
+    simulate) "$@" --config "${CONFIG}" --simulate "${WORK}/scenario.txt" 2>> "${WORK}/events.log" ;;
+    bench)    "$@" --config "${CONFIG}" --bench "${BENCH_INPUT}" --bench-frames "${PGO_BENCH_FRAMES}" \
+                  2>> "${WORK}/events.log" ;;
+    esac
+}
+WORKLOADS="simulate${BENCH_INPUT:+ bench}"
+
+if [ "${MODE}" = train ]; then
+    for W in ${WORKLOADS}; do
+        echo "pgo: training on ${W}"
+        run "${W}" "$2" > /dev/null
+    done
+    exit 0
+fi
+
+if [ "${MODE}" != report ] || [ $# -ne 3 ]; then
+    sed -n '4,5p' "$0" | sed 's/^# //'
+    exit 1
+fi
+BASE="$2"
+PGO="$3"
+
+# best_ms <binary> <workload> — fastest of PGO_RUNS runs
+best_ms() {
+    local best=0 t0 ms i
+    for i in $(seq "${PGO_RUNS}"); do
+        t0=$(date +%s%N)
+        run "$2" "$1" > "${WORK}/$2.$(basename "$1").json"
+        ms=$(( ($(date +%s%N) - t0) / 1000000 ))
+        if [ "${best}" -eq 0 ] || [ "${ms}" -lt "${best}" ]; then best="${ms}"; fi
+    done
+    echo "${best}"
+}
+
+echo "Workload      base_ms   pgo_ms  speedup"
+for W in ${WORKLOADS}; do
+    B=$(best_ms "${BASE}" "${W}")
+    P=$(best_ms "${PGO}" "${W}")
+    awk -v w="${W}" -v b="${B}" -v p="${P}" 'BEGIN { printf "%-10s %9d %8d %8.3fx\n", w, b, p, b / p }'
+done
+echo
+
+# Per function: samples over the same deterministic workloads, so a
+# ratio of sample counts is a ratio of time. Symbols are folded over GCC's
+# clones (.part, .constprop, .cold, .lto_priv); a function missing from
+# the PGO build was inlined into its caller.
+if command -v perf > /dev/null && perf record -q -o /dev/null -- true > /dev/null 2>&1; then
+    for BIN in "${BASE}" "${PGO}"; do
+        NAME="$(basename "${BIN}")"
+        : > "${WORK}/perf.${NAME}.txt"
+        for W in ${WORKLOADS}; do
+            run "${W}" perf record -q -F 999 -o "${WORK}/perf.${NAME}.${W}.data" -- "${BIN}" > /dev/null
+            perf report -i "${WORK}/perf.${NAME}.${W}.data" --stdio -q -n --no-children \
+                --sort dso,symbol 2> /dev/null >> "${WORK}/perf.${NAME}.txt"
+        done
+    done
+    BASE_TXT="${WORK}/perf.$(basename "${BASE}").txt"
+    awk -v top="${PGO_TOP}" -v base="$(basename "${BASE}")" -v pgo="$(basename "${PGO}")" \
+        -v base_txt="${BASE_TXT}" '
+        FNR == 1 { side = FILENAME == base_txt ? "b" : "p" }
+        $4 == "[.]" {
+            own = $3 == (side == "b" ? base : pgo)
+            sym = own ? $5 : "(libraries: x264, libav*, libc)"
+            sub(/\..*$/, "", sym)
+            n[side, sym] += $2; tot[side] += $2
+            if (side == "b") seen[sym] = 1
+        }
+        END {
+            printf "%-40s %10s %10s %8s\n", "function", "base_smp", "pgo_smp", "speedup"
+            for (k = 0; k < top; k++) {
+                best = ""
+                for (s in seen) if (!(s in done) && (best == "" || n["b", s] > n["b", best])) best = s
+                if (best == "") break
+                done[best] = 1
+                if (n["p", best]) printf "%-40s %10d %10d %7.3fx\n", best, n["b", best], n["p", best], n["b", best] / n["p", best]
+                else              printf "%-40s %10d %10s %8s\n", best, n["b", best], "inlined", "-"
+            }
+            printf "%-40s %10d %10d %7.3fx\n", "total", tot["b"], tot["p"], tot["p"] ? tot["b"] / tot["p"] : 0
+        }' "${BASE_TXT}" "${WORK}/perf.$(basename "${PGO}").txt"
+elif [ -n "${BENCH_INPUT}" ]; then
+    # No perf: per main_loop stage from the last --bench run of each binary
+    echo "perf not available, per-stage times from --bench instead (ms per tick)"
+    for BIN in "${BASE}" "${PGO}"; do
+        grep -o '"stage_ms":{[^}]*}' "${WORK}/bench.$(basename "${BIN}").json" | \
+            sed 's/"stage_ms":{//; s/}//' | tr ',' '\n' | tr -d '"' > "${WORK}/stages.$(basename "${BIN}").txt"
+    done
+    printf "%-20s %10s %10s %8s\n" stage base_ms pgo_ms speedup
+    paste -d: "${WORK}/stages.$(basename "${BASE}").txt" "${WORK}/stages.$(basename "${PGO}").txt" | \
+        awk -F: '{ printf "%-20s %10.3f %10.3f %7.3fx\n", $1, $2, $4, ($4 > 0 ? $2 / $4 : 0) }'
+else
+    echo "perf not available and no --bench input, no per-function report"
+fi
@@ -0,0 +1,61 @@
+#!/bin/bash
+# probe.sh - Measure the latency srt_compositor adds, entirely on loopback
+#
+# Usage: ./probe.sh [seconds] [port]
+#
+# Starts the compositor with latency_probe on, feeds it from the built-in
+# probe sender (--probe-send) and summarises the per-frame "probe" events.
+# Needs no camera, network or Twitch key, so it also runs in CI.
+
+set -e
+
+SECONDS_TO_RUN="${1:-20}"
+PORT="${2:-9710}"
+BG_VIDEO="black.mp4"
+
+if [ ! -f "./srt_compositor" ]; then
+    echo "Error: ./srt_compositor not found. Run 'make' first."
+    exit 1
+fi
+
+WORK="$(mktemp -d)"
+trap 'kill $(jobs -p) 2>/dev/null || true; rm -rf "${WORK}"' EXIT
+
+cat > "${WORK}/probe.json" <<JSON
+{
+  "srt_url": "srt://127.0.0.1:${PORT}?mode=listener&latency=20",
+  "bg_file": "${BG_VIDEO}",
+  "stream_id": "probe",
+  "mux_mode": "lowlatency",
+  "governor_max_level": 0,
+  "latency_probe": true
+}
+JSON
+
+./srt_compositor --config "${WORK}/probe.json" > /dev/null 2> "${WORK}/events.log" &
+COMPOSITOR=$!
+sleep 1
+./srt_compositor --config "${WORK}/probe.json" \
+    --probe-send "srt://127.0.0.1:${PORT}?mode=caller&latency=20" 2> "${WORK}/sender.log" &
+SENDER=$!
+
+sleep "${SECONDS_TO_RUN}"
+kill -INT "${SENDER}" "${COMPOSITOR}" 2>/dev/null || true
+wait "${SENDER}" "${COMPOSITOR}" 2>/dev/null || true
+
+FRAMES=$(grep -c '"event":"probe"' "${WORK}/events.log" || true)
+if [ "${FRAMES}" -eq 0 ]; then
+    echo "Error: no probe frames measured. Compositor log:"
+    cat "${WORK}/events.log" "${WORK}/sender.log"
+    exit 1
+fi
+
+echo "Frames measured: ${FRAMES} (milliseconds)"
+printf "%-22s %8s %8s %8s %8s\n" "stage" "avg" "p50" "p95" "max"
+for FIELD in sender_to_ingest_ms ingest_to_decode_ms decode_to_encode_ms encode_to_write_ms total_ms; do
+    grep '"event":"probe"' "${WORK}/events.log" | \
+        grep -o "\"${FIELD}\":[-0-9.]*" | cut -d: -f2 | sort -n | \
+        awk -v f="${FIELD}" '{ v[NR] = $1; s += $1 }
+            END { printf "%-22s %8.2f %8.2f %8.2f %8.2f\n", f, s / NR,
+                  v[int((NR - 1) * 0.50) + 1], v[int((NR - 1) * 0.95) + 1], v[NR] }'
+done
@@ -0,0 +1,188 @@
+#!/bin/bash
+# soak.sh - Long-running stability and leak gate, entirely on loopback
+#
+# Usage: ./soak.sh [hours] [port]
+#
+# Runs the compositor behind udp_impair (loss, reordering, delay, jitter
+# bursts) fed by the built-in probe sender, which is restarted whenever a
+# burst kills its connection. Every SOAK_SAMPLE seconds one CSV row goes
+# to ${SOAK_DIR}/samples.csv; at the end a summary is printed and the
+# script exits non-zero if a gate failed. Needs no root, netem or network.
+#
+# Environment:
+#   IMPAIR_ARGS        udp_impair options (see ./udp_impair with no arguments)
+#   SOAK_SAMPLE        seconds between samples (60)
+#   SOAK_WARMUP        seconds before the RSS baseline is taken (300)
+#   SOAK_MAX_RSS_MB    allowed RSS growth after warm-up (32)
+#   SOAK_MAX_GAP_MS    allowed hole in the output timeline (100)
+#   SOAK_DIR           keep logs here instead of a temporary directory
+
+set -e
+
+HOURS="${1:-4}"
+PORT="${2:-9720}"
+IMPAIR_PORT=$((PORT + 1))
+BG_VIDEO="black.mp4"
+IMPAIR_ARGS="${IMPAIR_ARGS:---loss 0.5 --reorder 1 --delay 10 --jitter 5 --burst-every 900 --burst-len 4000}"
+SOAK_SAMPLE="${SOAK_SAMPLE:-60}"
+SOAK_WARMUP="${SOAK_WARMUP:-300}"
+SOAK_MAX_RSS_MB="${SOAK_MAX_RSS_MB:-32}"
+SOAK_MAX_GAP_MS="${SOAK_MAX_GAP_MS:-100}"
+
+for BIN in ./srt_compositor ./udp_impair; do
+    if [ ! -x "${BIN}" ]; then
+        echo "Error: ${BIN} not found. Run 'make all udp_impair' first."
+        exit 1
+    fi
+done
+if ! command -v ffmpeg > /dev/null; then
+    echo "Error: ffmpeg not found (used to check output continuity)."
+    exit 1
+fi
+
+if [ -n "${SOAK_DIR}" ]; then
+    WORK="${SOAK_DIR}"
+    mkdir -p "${WORK}"
+    trap 'kill $(jobs -p) 2>/dev/null || true' EXIT
+else
+    WORK="$(mktemp -d)"
+    trap 'kill $(jobs -p) 2>/dev/null || true; rm -rf "${WORK}"' EXIT
+fi
+
+cat > "${WORK}/soak.json" <<JSON
+{
+  "srt_url": "srt://127.0.0.1:${PORT}?mode=listener&latency=120",
+  "bg_file": "${BG_VIDEO}",
+  "stream_id": "soak",
+  "bg_unmute_delay": 2
+}
+JSON
+
+# Output continuity: per-packet timestamps from the FLV, checked per
+# stream (0 = video, 1 = audio) for holes and backwards steps. framemd5
+# with -c copy decodes nothing. The checker rewrites continuity.txt as it
+# goes and exits non-zero if it saw a problem.
+mkfifo "${WORK}/out.flv"
+ffmpeg -hide_banner -loglevel error -f flv -i "${WORK}/out.flv" -c copy -f framemd5 - 2> /dev/null | \
+    awk -F', *' -v max_gap="${SOAK_MAX_GAP_MS}" -v out="${WORK}/continuity.txt" '
+        function dump(   s) {
+            printf "" > out
+            for (s in pkts)
+                printf "stream%d packets=%d holes=%d worst_hole_ms=%.0f backwards=%d\n",
+                       s, pkts[s], holes[s] + 0, worst[s] + 0, back[s] + 0 > out
+            close(out)
+        }
+        /^#tb/ { split($0, tb, /[ :\/]+/); unit[tb[2] + 0] = tb[3] * 1000 / tb[4]; next }
+        /^#/   { next }
+        {
+            s = $1 + 0; dts = $2 * unit[s]; pkts[s]++
+            if (s in last) {
+                if (dts < last[s]) back[s]++
+                gap = dts - last[s] - lastdur[s]
+                if (gap > max_gap) { holes[s]++; if (gap > worst[s]) worst[s] = gap }
+            }
+            last[s] = dts; lastdur[s] = $4 * unit[s]
+            if (++n % 1000 == 0) dump()
+        }
+        END {
+            dump()
+            for (s in pkts) if (holes[s] || back[s]) exit 1
+            exit (n == 0)
+        }' &
+CHECKER=$!
+
+./srt_compositor --config "${WORK}/soak.json" > "${WORK}/out.flv" 2> "${WORK}/events.log" &
+COMPOSITOR=$!
+./udp_impair --listen "${IMPAIR_PORT}" --target "127.0.0.1:${PORT}" ${IMPAIR_ARGS} \
+    --stats "${SOAK_SAMPLE}" 2> "${WORK}/impair.log" &
+sleep 1
+
+# The sender exits when a burst breaks its connection; start it again
+(
+    while kill -0 "${COMPOSITOR}" 2>/dev/null; do
+        ./srt_compositor --config "${WORK}/soak.json" \
+            --probe-send "srt://127.0.0.1:${IMPAIR_PORT}?mode=caller&latency=120" \
+            >> "${WORK}/sender.log" 2>&1 || true
+        sleep 2
+    done
+) &
+
+rss_kb() { awk '/^VmRSS/ { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0; }
+last_stats() { grep '"event":"stats"' "${WORK}/events.log" | tail -n 1; }
+field() { grep -o "\"$1\":[-0-9.]*" | head -n 1 | cut -d: -f2; }
+
+echo "elapsed_s,rss_kb,fps,tick_p99_us,late_ticks,srt_connects,srt_connected,srt_local_fifo_ms,bg_fifo_ms,video_pkts" \
+    > "${WORK}/samples.csv"
+END=$(( $(date +%s) + $(awk -v h="${HOURS}" 'BEGIN { printf "%d", h * 3600 }') ))
+START=$(date +%s)
+BASE_RSS=0
+STATUS=running
+while [ "$(date +%s)" -lt "${END}" ]; do
+    sleep "${SOAK_SAMPLE}"
+    if ! kill -0 "${COMPOSITOR}" 2>/dev/null; then
+        STATUS=exited
+        break
+    fi
+    NOW=$(( $(date +%s) - START ))
+    RSS=$(rss_kb "${COMPOSITOR}")
+    if [ "${BASE_RSS}" -eq 0 ] && [ "${NOW}" -ge "${SOAK_WARMUP}" ]; then
+        BASE_RSS="${RSS}"
+    fi
+    S="$(last_stats)"
+    VIDEO_PKTS=$(grep -o '^stream0 packets=[0-9]*' "${WORK}/continuity.txt" 2>/dev/null | cut -d= -f2)
+    echo "${NOW},${RSS},$(echo "$S" | field fps),$(echo "$S" | field p99),$(echo "$S" | field late_ticks),$(echo "$S" | field connects),$(echo "$S" | grep -q '"srt_connected":true' && echo 1 || echo 0),$(echo "$S" | field srt_local),$(echo "$S" | field bg),${VIDEO_PKTS}" \
+        >> "${WORK}/samples.csv"
+done
+[ "${STATUS}" = running ] && STATUS=completed
+FINAL_RSS=$(rss_kb "${COMPOSITOR}")
+
+kill -INT "${COMPOSITOR}" 2>/dev/null || true
+wait "${COMPOSITOR}" 2>/dev/null || true
+CONTINUITY=0
+wait "${CHECKER}" || CONTINUITY=$?
+kill $(jobs -p) 2>/dev/null || true
+wait 2>/dev/null || true
+
+# ---- Summary ----
+FAIL=0
+echo "Soak ${STATUS} after $(( $(date +%s) - START )) s, logs in ${WORK}"
+
+DROPS_TIMEOUT=$(grep -c '"event":"srt_dropped".*"timeout"' "${WORK}/events.log" || true)
+DROPS_ERROR=$(grep -c '"event":"srt_dropped".*"read_error"' "${WORK}/events.log" || true)
+echo "SRT: connects=$(last_stats | field connects) drops_timeout=${DROPS_TIMEOUT} drops_read_error=${DROPS_ERROR}"
+echo "Impairment: $(grep impair_stats "${WORK}/impair.log" | tail -n 1)"
+
+awk -F, 'NR > 1 && $3 != "" {
+        n++; fps += $3; if (min_fps == "" || $3 < min_fps) min_fps = $3
+        if ($4 > p99) p99 = $4; late = $5
+        if ($7 == 1) { if (lo == "" || $8 < lo) lo = $8; if ($8 > hi) hi = $8 }
+    }
+    END { if (n) printf "Ticks: avg_fps=%.2f min_fps=%.2f worst_p99_us=%d late_ticks=%d\n" \
+                        "Audio: srt_local_fifo_ms min=%s max=%s (while connected)\n",
+                        fps / n, min_fps, p99, late, lo, hi }' "${WORK}/samples.csv"
+
+if [ "${STATUS}" = exited ]; then
+    echo "FAIL: compositor exited early"
+    tail -n 20 "${WORK}/events.log"
+    FAIL=1
+fi
+
+if [ "${BASE_RSS}" -gt 0 ]; then
+    GROWTH_KB=$(( FINAL_RSS - BASE_RSS ))
+    echo "Memory: rss_kb baseline=${BASE_RSS} final=${FINAL_RSS} growth=${GROWTH_KB}"
+    if [ "${GROWTH_KB}" -gt $(( SOAK_MAX_RSS_MB * 1024 )) ]; then
+        echo "FAIL: RSS grew more than ${SOAK_MAX_RSS_MB} MB after warm-up"
+        FAIL=1
+    fi
+else
+    echo "Memory: run shorter than SOAK_WARMUP, no RSS baseline"
+fi
+
+sed 's/^/Output /' "${WORK}/continuity.txt" 2>/dev/null || echo "Output: no packets"
+if [ "${CONTINUITY}" -ne 0 ]; then
+    echo "FAIL: output timeline has holes, goes backwards or is empty"
+    FAIL=1
+fi
+
+[ "${FAIL}" -eq 0 ] && echo "PASS"
+exit "${FAIL}"
@@ -15,6 +15,7 @@
 
 Config g_cfg;
 volatile int g_running = 1;
+int64_t g_sim_now_us = -1;
 
 /* ================================================================== */
 /*  Minimal JSON config reader                                         */
@@ -64,6 +65,234 @@ static void json_get_str(const char *json, const char *key,
     buf[len] = '\0';
 }
 
+static int json_get_bool(const char *json, const char *key, int def) {
+    char pattern[256];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    const char *p = strstr(json, pattern);
+    if (!p) return def;
+    p = strchr(p + strlen(pattern), ':');
+    if (!p) return def;
+    while (*p == ':' || *p == ' ' || *p == '\t') p++;
+    if (strncmp(p, "true", 4) == 0)  return 1;
+    if (strncmp(p, "false", 5) == 0) return 0;
+    if (*p == '"') return def;
+    return strtol(p, NULL, 10) != 0;
+}
+
+/* Returns a malloc'd copy of the {...} object stored under key, or NULL.
+ * Only keys of json's outermost object match, never string values or
+ * keys of nested objects (a profile may be named like a preset). The
+ * flat getters above can then be run on the returned sub-object. */
+static char *json_get_object(const char *json, const char *key) {
+    size_t klen = strlen(key);
+    const char *p = strchr(json, '{');
+    int depth = 0;
+    for (; p && *p; p++) {
+        if (*p == '{' || *p == '[') { depth++; continue; }
+        if (*p == '}' || *p == ']') {
+            if (--depth == 0) return NULL;
+            continue;
+        }
+        if (*p != '"') continue;
+
+        /* A string is a key when ':' follows it */
+        const char *s = ++p;
+        while (*p && *p != '"') {
+            if (*p == '\\' && p[1]) p++;
+            p++;
+        }
+        if (!*p) return NULL;
+        const char *c = p + 1;
+        while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') c++;
+        if (depth != 1 || *c != ':' || (size_t)(p - s) != klen || strncmp(s, key, klen) != 0)
+            continue;
+        c++;
+        while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') c++;
+        if (*c != '{') return NULL;
+        p = c;
+        break;
+    }
+    if (!p || *p != '{') return NULL;
+
+    int in_str = 0;
+    const char *q = p;
+    depth = 0;
+    for (; *q; q++) {
+        if (in_str) {
+            if (*q == '\\' && q[1]) q++;
+            else if (*q == '"') in_str = 0;
+        } else if (*q == '"') in_str = 1;
+        else if (*q == '{') depth++;
+        else if (*q == '}' && --depth == 0) break;
+    }
+    if (!*q) return NULL;
+
+    size_t len = (size_t)(q - p) + 1;
+    char *obj = malloc(len + 1);
+    if (!obj) return NULL;
+    memcpy(obj, p, len);
+    obj[len] = '\0';
+    return obj;
+}
+
+/* ================================================================== */
+/*  Encoder profiles                                                   */
+/* ================================================================== */
+
+/* The built-in "default" profile: what open_output always used to do */
+static void encoder_profile_defaults(EncoderProfile *p) {
+    memset(p, 0, sizeof(*p));
+    strcpy(p->name,    "default");
+    strcpy(p->preset,  "ultrafast");
+    strcpy(p->tune,    "zerolatency");
+    strcpy(p->profile, "main");
+    p->rc_mode        = RC_ABR;
+    p->crf            = 23;
+    p->threads        = 4;
+    p->sliced_threads = 0;
+    p->gop_seconds    = 2.0;
+    p->lookahead      = -1;
+}
+
+/* Overlay the keys present in obj onto p */
+static void parse_encoder_profile(const char *obj, EncoderProfile *p) {
+    char rc[16], tt[16];
+    json_get_str(obj, "preset",  p->preset,  sizeof(p->preset),  p->preset);
+    json_get_str(obj, "tune",    p->tune,    sizeof(p->tune),    p->tune);
+    json_get_str(obj, "profile", p->profile, sizeof(p->profile), p->profile);
+
+    json_get_str(obj, "rc", rc, sizeof(rc),
+                 p->rc_mode == RC_CRF ? "crf" : p->rc_mode == RC_CBR ? "cbr" : "abr");
+    p->rc_mode = strcmp(rc, "crf") == 0 ? RC_CRF :
+                 strcmp(rc, "cbr") == 0 ? RC_CBR :
+                 strcmp(rc, "abr") == 0 ? RC_ABR : -1;
+
+    json_get_str(obj, "thread_type", tt, sizeof(tt), p->sliced_threads ? "slice" : "frame");
+    p->sliced_threads = strcmp(tt, "slice") == 0 ? 1 :
+                        strcmp(tt, "frame") == 0 ? 0 : -1;
+
+    p->crf           = json_get_int(obj,    "crf",           p->crf);
+    p->bitrate       = json_get_int(obj,    "bitrate",       p->bitrate);
+    p->maxrate       = json_get_int(obj,    "maxrate",       p->maxrate);
+    p->bufsize       = json_get_int(obj,    "bufsize",       p->bufsize);
+    p->threads       = json_get_int(obj,    "threads",       p->threads);
+    p->intra_refresh = json_get_bool(obj,   "intra_refresh", p->intra_refresh);
+    p->gop_seconds   = json_get_double(obj, "gop_seconds",   p->gop_seconds);
+    p->lookahead     = json_get_int(obj,    "lookahead",     p->lookahead);
+
+    /* CBR without explicit VBV: one second of buffer at the target rate */
+    if (p->rc_mode == RC_CBR) {
+        int rate = p->bitrate > 0 ? p->bitrate : g_cfg.video_bitrate;
+        if (p->maxrate <= 0) p->maxrate = rate;
+        if (p->bufsize <= 0) p->bufsize = rate;
+    }
+}
+
+static int name_in_list(const char *name, const char *const *list) {
+    for (; *list; list++)
+        if (strcmp(name, *list) == 0) return 1;
+    return 0;
+}
+
+static int validate_encoder_profile(const EncoderProfile *p, char *err, size_t size) {
+    static const char *const presets[] = { "ultrafast", "superfast", "veryfast", "faster",
+        "fast", "medium", "slow", "slower", "veryslow", "placebo", NULL };
+    static const char *const tunes[] = { "film", "animation", "grain", "stillimage",
+        "psnr", "ssim", "fastdecode", "zerolatency", NULL };
+    static const char *const profiles[] = { "baseline", "main", "high", NULL };
+
+    if (!name_in_list(p->preset, presets))
+        { snprintf(err, size, "unknown preset '%s'", p->preset); return -1; }
+    if (p->tune[0]) {
+        char tmp[sizeof(p->tune)];
+        strcpy(tmp, p->tune);
+        for (char *save = NULL, *t = strtok_r(tmp, ",", &save); t; t = strtok_r(NULL, ",", &save))
+            if (!name_in_list(t, tunes))
+                { snprintf(err, size, "unknown tune '%s'", t); return -1; }
+    }
+    if (!name_in_list(p->profile, profiles))
+        { snprintf(err, size, "unknown profile '%s'", p->profile); return -1; }
+    if (p->rc_mode < 0)
+        { snprintf(err, size, "rc must be abr, crf or cbr"); return -1; }
+    if (p->sliced_threads < 0)
+        { snprintf(err, size, "thread_type must be slice or frame"); return -1; }
+    if (p->rc_mode == RC_CRF && (p->crf < 0 || p->crf > 51))
+        { snprintf(err, size, "crf %d out of range 0-51", p->crf); return -1; }
+    if (p->bitrate < 0 || p->maxrate < 0 || p->bufsize < 0)
+        { snprintf(err, size, "negative bitrate/maxrate/bufsize"); return -1; }
+    if (p->maxrate > 0 && p->bufsize <= 0)
+        { snprintf(err, size, "maxrate needs bufsize"); return -1; }
+    if (p->threads < 0 || p->threads > 128)
+        { snprintf(err, size, "threads %d out of range 0-128", p->threads); return -1; }
+    if (p->gop_seconds <= 0.0 || p->gop_seconds > 20.0)
+        { snprintf(err, size, "gop_seconds must be in (0, 20]"); return -1; }
+    if (p->lookahead < -1 || p->lookahead > 250)
+        { snprintf(err, size, "lookahead %d out of range -1-250", p->lookahead); return -1; }
+    return 0;
+}
+
+static void apply_encoder_profile(AVCodecContext *c, const EncoderProfile *p) {
+    int rate = p->bitrate > 0 ? p->bitrate : g_cfg.video_bitrate;
+
+    c->gop_size     = (int)lrint(p->gop_seconds * av_q2d(g_cfg.out_rate));
+    if (c->gop_size < 1) c->gop_size = 1;
+    c->thread_count = p->threads;
+    c->thread_type  = p->sliced_threads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+
+    av_opt_set(c->priv_data, "preset",  p->preset,  0);
+    if (p->tune[0])
+        av_opt_set(c->priv_data, "tune", p->tune, 0);
+    av_opt_set(c->priv_data, "profile", p->profile, 0);
+
+    switch (p->rc_mode) {
+    case RC_CRF:
+        av_opt_set_int(c->priv_data, "crf", p->crf, 0);
+        break;
+    case RC_CBR:
+        c->bit_rate = rate;
+        av_opt_set(c->priv_data, "nal-hrd", "cbr", 0);
+        break;
+    default:
+        c->bit_rate = rate;
+        break;
+    }
+    if (p->maxrate > 0) {
+        c->rc_max_rate    = p->maxrate;
+        c->rc_buffer_size = p->bufsize;
+    }
+    if (p->intra_refresh)
+        av_opt_set_int(c->priv_data, "intra-refresh", 1, 0);
+    if (p->lookahead >= 0)
+        av_opt_set_int(c->priv_data, "rc-lookahead", p->lookahead, 0);
+}
+
+static void config_defaults(void) {
+    g_cfg.out_width       = 1280;
+    g_cfg.out_height      = 720;
+    g_cfg.out_fps         = 30;
+    g_cfg.out_rate        = (AVRational){30, 1};
+    g_cfg.late_policy     = LATE_CATCHUP;
+    g_cfg.video_bitrate   = 4000000;
+    g_cfg.audio_bitrate   = 128000;
+    g_cfg.sample_rate     = 48000;
+    g_cfg.bg_unmute_delay = 5.0;
+    g_cfg.out_channels    = 2;
+    g_cfg.srt_timeout_us  = 2000000;
+    g_cfg.srt_retry_us    = 500000;
+    g_cfg.idr_min_interval = 1.0;
+    g_cfg.out_queue_kb    = 2048;
+    strcpy(g_cfg.record_format, "mp4");
+    g_cfg.record_queue_kb = 16384;
+    g_cfg.bitrate_ramp    = 2.0;
+    g_cfg.delay_max_seconds = 300.0;
+    g_cfg.replay_max_kb   = 65536;
+    strcpy(g_cfg.replay_path, "replay-%Y%m%d-%H%M%S.mp4");
+    g_cfg.thumb_interval  = 5.0;
+    g_cfg.thumb_width     = 320;
+    encoder_profile_defaults(&g_cfg.enc);
+    strncpy(g_cfg.bg_file, "background.mp4", sizeof(g_cfg.bg_file) - 1);
+}
+
 static int load_config(const char *path) {
     FILE *f = fopen(path, "r");
     if (!f) {
@@ -87,7 +316,10 @@ static int load_config(const char *path) {
 
     g_cfg.out_width      = json_get_int(buf, "out_width",      1280);
     g_cfg.out_height     = json_get_int(buf, "out_height",     720);
-    g_cfg.out_fps        = json_get_int(buf, "out_fps",        30);
+    double fps           = json_get_double(buf, "out_fps",     30.0);
+    if (fps < 1.0 || fps > 240.0) fps = 30.0;
+    g_cfg.out_rate       = fps_to_rational(fps);
+    g_cfg.out_fps        = (int)lrint(fps);
     g_cfg.video_bitrate  = json_get_int(buf, "video_bitrate",  4000000);
     g_cfg.audio_bitrate  = json_get_int(buf, "audio_bitrate",  128000);
     g_cfg.sample_rate    = json_get_int(buf, "sample_rate",    48000);
@@ -95,6 +327,86 @@ static int load_config(const char *path) {
     g_cfg.out_channels   = 2;
     g_cfg.srt_timeout_us = 2000000;
     g_cfg.srt_retry_us   = 500000;
+    g_cfg.idr_min_interval = json_get_double(buf, "idr_min_interval", 1.0);
+    g_cfg.out_queue_kb   = json_get_int(buf, "out_queue_kb",   2048);
+    if (g_cfg.out_queue_kb < 64) g_cfg.out_queue_kb = 64;
+    json_get_str(buf, "record_path",   g_cfg.record_path,   sizeof(g_cfg.record_path),   "");
+    json_get_str(buf, "record_format", g_cfg.record_format, sizeof(g_cfg.record_format), "mp4");
+    g_cfg.record_queue_kb = json_get_int(buf, "record_queue_kb", 16384);
+    if (g_cfg.record_queue_kb < 256) g_cfg.record_queue_kb = 256;
+    g_cfg.bg_video_bitrate = json_get_int(buf, "bg_video_bitrate", 0);
+    g_cfg.bitrate_ramp     = json_get_double(buf, "bitrate_ramp", 2.0);
+    if (g_cfg.bitrate_ramp < 0.0) g_cfg.bitrate_ramp = 0.0;
+
+    json_get_str(buf, "shm_ring_path", g_cfg.shm_ring_path, sizeof(g_cfg.shm_ring_path), "");
+    g_cfg.shm_ring_kb = json_get_int(buf, "shm_ring_kb", 16384);
+    if (g_cfg.shm_ring_kb < 1024) g_cfg.shm_ring_kb = 1024;
+
+    g_cfg.delay_max_seconds = json_get_double(buf, "delay_max_seconds", 300.0);
+    if (g_cfg.delay_max_seconds < 0.0) g_cfg.delay_max_seconds = 0.0;
+    g_cfg.delay_seconds = json_get_double(buf, "delay_seconds", 0.0);
+    if (g_cfg.delay_seconds < 0.0) g_cfg.delay_seconds = 0.0;
+    if (g_cfg.delay_seconds > g_cfg.delay_max_seconds) g_cfg.delay_seconds = g_cfg.delay_max_seconds;
+    json_get_str(buf, "control_socket", g_cfg.control_socket, sizeof(g_cfg.control_socket), "");
+    json_get_str(buf, "metrics_socket", g_cfg.metrics_socket, sizeof(g_cfg.metrics_socket), "");
+    json_get_str(buf, "trace_path", g_cfg.trace_path, sizeof(g_cfg.trace_path), "");
+    g_cfg.latency_probe = json_get_bool(buf, "latency_probe", 0);
+    g_cfg.perf_counters = json_get_bool(buf, "perf_counters", 0);
+    g_cfg.replay_seconds = json_get_double(buf, "replay_seconds", 0.0);
+    if (g_cfg.replay_seconds < 0.0) g_cfg.replay_seconds = 0.0;
+    g_cfg.replay_max_kb  = json_get_int(buf, "replay_max_kb", 65536);
+    if (g_cfg.replay_max_kb < 1024) g_cfg.replay_max_kb = 1024;
+    json_get_str(buf, "replay_path", g_cfg.replay_path, sizeof(g_cfg.replay_path),
+                 "replay-%Y%m%d-%H%M%S.mp4");
+    g_cfg.governor_max_level = json_get_int(buf, "governor_max_level", 0);
+    if (g_cfg.governor_max_level < 0) g_cfg.governor_max_level = 0;
+    if (g_cfg.governor_max_level >= GOV_LEVELS) g_cfg.governor_max_level = GOV_LEVELS - 1;
+    json_get_str(buf, "thumb_path", g_cfg.thumb_path, sizeof(g_cfg.thumb_path), "");
+    g_cfg.thumb_interval = json_get_double(buf, "thumb_interval", 5.0);
+    if (g_cfg.thumb_interval < 0.5) g_cfg.thumb_interval = 0.5;
+    g_cfg.thumb_width    = json_get_int(buf, "thumb_width", 320);
+
+    char mux_mode[32];
+    json_get_str(buf, "mux_mode", mux_mode, sizeof(mux_mode), "interleaved");
+    g_cfg.mux_mode = strcmp(mux_mode, "lowlatency") == 0 ? MUX_LOWLATENCY : MUX_INTERLEAVED;
+
+    char policy[32];
+    json_get_str(buf, "late_policy", policy, sizeof(policy), "catchup");
+    if      (strcmp(policy, "skip") == 0)      g_cfg.late_policy = LATE_SKIP;
+    else if (strcmp(policy, "duplicate") == 0) g_cfg.late_policy = LATE_DUPLICATE;
+    else                                       g_cfg.late_policy = LATE_CATCHUP;
+
+    /* Encoder profile: built-in "default", optionally overridden by the
+     * named entry of the "encoder_profiles" section */
+    char prof_name[64];
+    json_get_str(buf, "encoder_profile", prof_name, sizeof(prof_name), "default");
+    encoder_profile_defaults(&g_cfg.enc);
+    snprintf(g_cfg.enc.name, sizeof(g_cfg.enc.name), "%s", prof_name);
+
+    char *profiles = json_get_object(buf, "encoder_profiles");
+    char *prof = profiles ? json_get_object(profiles, prof_name) : NULL;
+    free(profiles);
+    if (!prof && strcmp(prof_name, "default") != 0) {
+        char extra[256];
+        snprintf(extra, sizeof(extra), "\"message\":\"Unknown encoder profile: %s\"", prof_name);
+        jlog("error", extra);
+        free(buf);
+        return -1;
+    }
+    if (prof) {
+        parse_encoder_profile(prof, &g_cfg.enc);
+        free(prof);
+    }
+
+    char err[128];
+    if (validate_encoder_profile(&g_cfg.enc, err, sizeof(err)) < 0) {
+        char extra[256];
+        snprintf(extra, sizeof(extra), "\"message\":\"Invalid encoder profile %s: %s\"",
+                 g_cfg.enc.name, err);
+        jlog("error", extra);
+        free(buf);
+        return -1;
+    }
 
     free(buf);
     return 0;
@@ -102,21 +414,358 @@ static int load_config(const char *path) {
 
 /* ================================================================== */
 /*  JSON status logging to stderr                                      */
+/*  jlog() formats into a lock-free ring and returns; a logger thread  */
+/*  writes the lines, so a slow reader of stderr never stalls          */
+/*  main_loop or the SRT thread. Before log_start() and after          */
+/*  log_shutdown() lines are written synchronously.                    */
 /* ================================================================== */
-static void jlog(const char *event, const char *extra) {
+
+#define LOG_COALESCE_US 1000000   /* window for folding flapping events */
+#define LOG_SUFFIX_MAX  32        /* room kept for ",\"coalesced\":N" */
+
+/* State transitions that repeat while a source flaps. Within the window
+ * only the latest of each is held; held lines are written, in arrival
+ * order and with a "coalesced" count, when the window ends or before any
+ * other line, so the log order never changes. */
+static const char *const log_coalesced[] = {
+    "srt_connected", "srt_dropped", "srt_active", "srt_grace",
+    "bg_audio_on", "video_srt", "video_bg", "bitrate", NULL
+};
+#define LOG_HELD_MAX 8
+
+static LogRing  g_log;
+static LogHeld  log_held[LOG_HELD_MAX];   /* by log_coalesced index */
+static uint64_t log_order;
+
+static int log_format(char *buf, size_t size, const char *event, const char *extra) {
     long ts = (long)time(NULL);
-    if (extra && extra[0]) {
-        fprintf(stderr, "{\"event\":\"%s\",\"ts\":%ld,\"stream_id\":\"%s\",%s}\n",
-                event, ts, g_cfg.stream_id, extra);
-    } else {
-        fprintf(stderr, "{\"event\":\"%s\",\"ts\":%ld,\"stream_id\":\"%s\"}\n",
-                event, ts, g_cfg.stream_id);
+    int n;
+    if (extra && extra[0])
+        n = snprintf(buf, size, "{\"event\":\"%s\",\"ts\":%ld,\"stream_id\":\"%s\",%s}\n",
+                     event, ts, g_cfg.stream_id, extra);
+    else
+        n = snprintf(buf, size, "{\"event\":\"%s\",\"ts\":%ld,\"stream_id\":\"%s\"}\n",
+                     event, ts, g_cfg.stream_id);
+    return n < (int)size ? n : -1;
+}
+
+static void jlog(const char *event, const char *extra) {
+    if (!atomic_load_explicit(&g_log.running, memory_order_acquire)) {
+        char line[LOG_LINE];
+        int n = log_format(line, sizeof(line), event, extra);
+        if (n > 0) log_write(line, (size_t)n);
+        return;
+    }
+
+    /* Claim a slot; a full ring means the logger is far behind: drop */
+    uint64_t pos = atomic_load_explicit(&g_log.head, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &g_log.slots[pos % LOG_SLOTS];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_log.head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&g_log.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&g_log.head, memory_order_relaxed);
+        }
+    }
+
+    int n = log_format(slot->line, LOG_LINE - LOG_SUFFIX_MAX, event, extra);
+    slot->len = n > 0 ? n : 0;
+    if (n <= 0) atomic_fetch_add_explicit(&g_log.dropped, 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&g_log.doorbell, 1, memory_order_release);
+    if (atomic_load_explicit(&g_log.waiting, memory_order_acquire))
+        syscall(SYS_futex, &g_log.doorbell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static int log_start(void) {
+    g_log.slots = av_mallocz(sizeof(*g_log.slots) * LOG_SLOTS);
+    if (!g_log.slots) return -1;
+    for (uint64_t i = 0; i < LOG_SLOTS; i++)
+        atomic_init(&g_log.slots[i].seq, i);
+    if (pthread_create(&g_log.thread, NULL, log_thread_func, NULL) != 0) {
+        av_freep(&g_log.slots);
+        return -1;
+    }
+    atomic_store_explicit(&g_log.running, 1, memory_order_release);
+    atexit(log_shutdown);
+    return 0;
+}
+
+/* Write out everything queued and stop the logger (atexit, idempotent).
+ * On an error return from main other threads may still be logging: a
+ * jlog that already claimed a slot writes into a ring nobody drains any
+ * more, so the slots stay allocated until the process exits. */
+static void log_shutdown(void) {
+    if (!atomic_load(&g_log.running)) return;
+    atomic_store(&g_log.stop, 1);
+    atomic_fetch_add(&g_log.doorbell, 1);
+    syscall(SYS_futex, &g_log.doorbell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(g_log.thread, NULL);
+    atomic_store(&g_log.running, 0);
+}
+
+static void *log_thread_func(void *arg) {
+    (void)arg;
+    uint64_t reported = 0;
+    for (;;) {
+        uint32_t bell = atomic_load_explicit(&g_log.doorbell, memory_order_acquire);
+        int n = log_drain();
+
+        int64_t now = av_gettime_relative();
+        for (int i = 0; i < LOG_HELD_MAX; i++)
+            if (log_held[i].count && now - log_held[i].last_us >= LOG_COALESCE_US) {
+                log_flush_held();
+                break;
+            }
+
+        uint64_t dropped = atomic_load_explicit(&g_log.dropped, memory_order_relaxed);
+        if (dropped != reported) {
+            char extra[96], line[256];
+            snprintf(extra, sizeof(extra), "\"dropped\":%llu,\"total\":%llu",
+                     (unsigned long long)(dropped - reported), (unsigned long long)dropped);
+            int len = log_format(line, sizeof(line), "log_dropped", extra);
+            if (len > 0) log_write(line, (size_t)len);
+            reported = dropped;
+        }
+
+        if (n == 0) {
+            if (atomic_load(&g_log.stop)) break;
+            /* Sleep until a producer rings, or the coalescing window needs a look */
+            struct timespec to = { 0, 100 * 1000 * 1000 };
+            atomic_store(&g_log.waiting, 1);
+            syscall(SYS_futex, &g_log.doorbell, FUTEX_WAIT_PRIVATE, bell, &to, NULL, 0);
+            atomic_store(&g_log.waiting, 0);
+        }
+    }
+    log_flush_held();
+    return NULL;
+}
+
+/* Write every filled slot in order; returns how many were consumed */
+static int log_drain(void) {
+    int n = 0;
+    for (;;) {
+        LogSlot *slot = &g_log.slots[g_log.tail % LOG_SLOTS];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != g_log.tail + 1)
+            break;
+        if (slot->len > 0)
+            log_emit(slot->line, slot->len);
+        atomic_store_explicit(&slot->seq, g_log.tail + LOG_SLOTS, memory_order_release);
+        g_log.tail++;
+        n++;
+    }
+    return n;
+}
+
+/* Write a line, or hold it if its event was written within the window */
+static void log_emit(const char *line, int len) {
+    static const char prefix[] = "{\"event\":\"";
+    int idx = -1;
+    if (strncmp(line, prefix, sizeof(prefix) - 1) == 0) {
+        const char *name = line + sizeof(prefix) - 1;
+        size_t name_len = strcspn(name, "\"");
+        for (int i = 0; log_coalesced[i] && i < LOG_HELD_MAX; i++)
+            if (strlen(log_coalesced[i]) == name_len &&
+                strncmp(log_coalesced[i], name, name_len) == 0) {
+                idx = i;
+                break;
+            }
+    }
+    if (idx < 0) {
+        log_flush_held();   /* output order always follows arrival order */
+        log_write(line, (size_t)len);
+        return;
+    }
+
+    LogHeld *h = &log_held[idx];
+    int64_t now = av_gettime_relative();
+    if (h->last_us && now - h->last_us < LOG_COALESCE_US) {
+        memcpy(h->line, line, (size_t)len);
+        h->len   = len;
+        h->order = ++log_order;
+        h->count++;
+        return;
+    }
+    log_flush_held();
+    log_write(line, (size_t)len);
+    h->last_us = now;
+}
+
+/* Write all held lines in arrival order, each with its coalesced count */
+static void log_flush_held(void) {
+    for (;;) {
+        LogHeld *next = NULL;
+        for (int i = 0; i < LOG_HELD_MAX; i++)
+            if (log_held[i].count && (!next || log_held[i].order < next->order))
+                next = &log_held[i];
+        if (!next) break;
+        /* Replace the closing "}\n" with the count */
+        int len = next->len - 2;
+        len += snprintf(next->line + len, LOG_SUFFIX_MAX, ",\"coalesced\":%d}\n", next->count);
+        log_write(next->line, (size_t)len);
+        next->count = 0;
+    }
+}
+
+static void log_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;   /* parent gone; nothing useful to do */
+        }
+        buf += n;
+        len -= (size_t)n;
     }
-    fflush(stderr);
 }
 
 static void signal_handler(int sig) { (void)sig; g_running = 0; }
 
+#ifdef SRT_TRACE
+/* ================================================================== */
+/*  Span tracing — Chrome trace JSON (chrome://tracing, ui.perfetto.dev) */
+/*  Dump with: kill -USR1 <pid>; a final dump is written at exit        */
+/* ================================================================== */
+
+static TraceState g_trace;
+static _Thread_local TraceBuf *t_trace;
+
+static int trace_start(void) {
+    signal(SIGUSR1, trace_signal);
+    if (pthread_create(&g_trace.thread, NULL, trace_thread_func, NULL) != 0)
+        return -1;
+    g_trace.running = 1;
+    return 0;
+}
+
+static void trace_stop(void) {
+    if (!g_trace.running) return;
+    atomic_store(&g_trace.stop, 1);
+    pthread_join(g_trace.thread, NULL);
+    g_trace.running = 0;
+    trace_dump();
+}
+
+/* Give the calling thread a ring. Threads that never call this record
+ * nothing, as does every thread when tracing is off. */
+static void trace_thread(const char *name) {
+    if (!g_trace.running || t_trace) return;
+    int i = atomic_load(&g_trace.count);
+    if (i >= TRACE_THREADS) return;
+    TraceBuf *b = calloc(1, sizeof(*b));
+    if (!b) return;
+    b->ev = calloc(TRACE_EVENTS, sizeof(TraceEvent));
+    if (!b->ev) { free(b); return; }
+    b->tid  = (pid_t)syscall(SYS_gettid);
+    b->name = name;
+    i = atomic_fetch_add(&g_trace.count, 1);
+    if (i >= TRACE_THREADS) { free(b->ev); free(b); return; }
+    g_trace.bufs[i] = b;
+    t_trace = b;
+}
+
+static int64_t trace_begin(void) {
+    return t_trace ? mono_ns() : 0;
+}
+
+static void trace_end(int64_t start_ns, const char *name) {
+    TraceBuf *b = t_trace;
+    if (!b || !start_ns) return;
+    uint64_t h = atomic_load_explicit(&b->head, memory_order_relaxed);
+    TraceEvent *e = &b->ev[h & (TRACE_EVENTS - 1)];
+    /* Keeps the overwrite behind the previous head store, for trace_dump */
+    atomic_thread_fence(memory_order_release);
+    e->name     = name;
+    e->start_ns = start_ns;
+    e->dur_ns   = mono_ns() - start_ns;
+    atomic_store_explicit(&b->head, h + 1, memory_order_release);
+}
+
+static void trace_signal(int sig) { (void)sig; atomic_store(&g_trace.dump, 1); }
+
+static void *trace_thread_func(void *arg) {
+    (void)arg;
+    while (!atomic_load(&g_trace.stop)) {
+        usleep(100000);
+        if (atomic_exchange(&g_trace.dump, 0))
+            trace_dump();
+    }
+    return NULL;
+}
+
+/* Write every thread's ring as complete ("X") events */
+static int trace_dump(void) {
+    char path[2048], part[2100];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    if (strftime(path, sizeof(path), g_cfg.trace_path, &tm) == 0)
+        return -1;
+    snprintf(part, sizeof(part), "%s.part", path);
+    FILE *f = fopen(part, "w");
+    if (!f) {
+        jlog("trace_failed", "\"message\":\"Cannot create trace file\"");
+        return -1;
+    }
+
+    TraceEvent *copy = malloc(TRACE_EVENTS * sizeof(TraceEvent));
+    if (!copy) { fclose(f); unlink(part); return -1; }
+    long pid = (long)getpid();
+    int64_t events = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+    int threads = atomic_load(&g_trace.count);
+    if (threads > TRACE_THREADS) threads = TRACE_THREADS;
+    for (int t = 0; t < threads; t++) {
+        TraceBuf *b = g_trace.bufs[t];
+        if (!b) continue;
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", t ? "," : "", pid, (int)b->tid, b->name);
+
+        uint64_t h1 = atomic_load_explicit(&b->head, memory_order_acquire);
+        uint64_t first = h1 > TRACE_EVENTS ? h1 - TRACE_EVENTS : 0;
+        for (uint64_t i = first; i < h1; i++)
+            copy[i - first] = b->ev[i & (TRACE_EVENTS - 1)];
+        /* Entries the owner reached again while we copied are torn. The
+         * fence keeps the copy's loads ahead of the re-read of head; with
+         * the one in trace_end, a copy that saw an overwrite sees its head. */
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t h2 = atomic_load_explicit(&b->head, memory_order_relaxed);
+        uint64_t valid = h2 + 1 > TRACE_EVENTS ? h2 + 1 - TRACE_EVENTS : 0;
+        for (uint64_t i = first > valid ? first : valid; i < h1; i++) {
+            const TraceEvent *e = &copy[i - first];
+            fprintf(f, ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    e->name, pid, (int)b->tid, e->start_ns / 1e3, e->dur_ns / 1e3);
+            events++;
+        }
+    }
+    fputs("]}\n", f);
+    free(copy);
+
+    int err = ferror(f);
+    if (fclose(f) != 0 || err || rename(part, path) < 0) {
+        unlink(part);
+        jlog("trace_failed", "\"message\":\"Cannot write trace file\"");
+        return -1;
+    }
+    char extra[2200];
+    snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"events\":%lld",
+             path, (long long)events);
+    jlog("trace_saved", extra);
+    return 0;
+}
+#endif /* SRT_TRACE */
+
 /* ================================================================== */
 /*  close / open helpers                                               */
 /* ================================================================== */
@@ -161,6 +810,15 @@ static SwrContext *make_resampler(AVCodecContext *dec) {
     return swr;
 }
 
+/* (Re)build the scaler from the decoder's size to the output size */
+static int source_scaler(SourceCtx *s, int flags) {
+    s->sws_ctx = sws_getCachedContext(s->sws_ctx,
+        s->video_dec_ctx->width, s->video_dec_ctx->height, s->video_dec_ctx->pix_fmt,
+        g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P, flags, NULL, NULL, NULL);
+    s->sws_flags = flags;
+    return s->sws_ctx ? 0 : -1;
+}
+
 static int open_background(AppState *app) {
     SourceCtx *s = &app->bg;
     int ret;
@@ -177,15 +835,18 @@ static int open_background(AppState *app) {
     }
 
     if ((ret = open_decoder(s->fmt_ctx, s->video_stream_idx, &s->video_dec_ctx)) < 0) return ret;
-    s->sws_ctx = sws_getContext(s->video_dec_ctx->width, s->video_dec_ctx->height,
-        s->video_dec_ctx->pix_fmt, g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P,
-        SWS_BILINEAR, NULL, NULL, NULL);
+    source_scaler(s, atomic_load(&app->sws_flags));
 
     if (s->audio_stream_idx >= 0) {
         if (open_decoder(s->fmt_ctx, s->audio_stream_idx, &s->audio_dec_ctx) >= 0)
             s->swr_ctx = make_resampler(s->audio_dec_ctx);
     }
-    jlog("bg_opened", NULL);
+
+    /* A silent single-frame file (still image) never needs decoding again */
+    AVStream *vst = s->fmt_ctx->streams[s->video_stream_idx];
+    app->bg_still = s->audio_stream_idx < 0 &&
+                    (vst->nb_frames == 1 || (vst->disposition & AV_DISPOSITION_ATTACHED_PIC));
+    jlog("bg_opened", app->bg_still ? "\"still\":true" : NULL);
     return 0;
 }
 
@@ -232,9 +893,7 @@ static int open_srt_source(SourceCtx *s, const char *url) {
     if ((ret = open_decoder(s->fmt_ctx, s->video_stream_idx, &s->video_dec_ctx)) < 0)
         { close_source(s); return ret; }
 
-    s->sws_ctx = sws_getContext(s->video_dec_ctx->width, s->video_dec_ctx->height,
-        s->video_dec_ctx->pix_fmt, g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P,
-        SWS_BILINEAR, NULL, NULL, NULL);
+    source_scaler(s, SWS_BILINEAR);
 
     if (s->audio_stream_idx >= 0) {
         if (open_decoder(s->fmt_ctx, s->audio_stream_idx, &s->audio_dec_ctx) >= 0)
@@ -260,48 +919,70 @@ static void *srt_thread_func(void *arg) {
     uint8_t  *tmp_data[4] = {0};
     int       tmp_linesize[4] = {0};
     av_image_alloc(tmp_data, tmp_linesize, g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P, 1);
+    TRACE_THREAD("srt");
+    atomic_store(&sh->tid, (int)syscall(SYS_gettid));
+
+    int bench = g_cfg.bench_input[0] != 0;
+    int64_t bench_pass_pics = 0;   /* pictures published since the last loop */
 
     while (g_running) {
         if (!src.fmt_ctx) {
-            if (open_srt_source(&src, g_cfg.srt_url) < 0) {
+            if (open_srt_source(&src, bench ? g_cfg.bench_input : g_cfg.srt_url) < 0) {
+                if (bench) {
+                    jlog("error", "\"message\":\"Cannot open bench input or it has no video stream\"");
+                    g_running = 0;
+                    break;
+                }
                 for (int w = 0; w < 10 && g_running; w++)
                     usleep((unsigned)(g_cfg.srt_retry_us / 10));
                 continue;
             }
-            pthread_mutex_lock(&sh->lock);
-            sh->connected = 1;
-            sh->last_frame_time = av_gettime_relative();
-            sh->has_video = 0;
-            av_audio_fifo_reset(sh->audio_fifo);
-            pthread_mutex_unlock(&sh->lock);
+            srt_set_connected(sh);
         }
 
         int ret = av_read_frame(src.fmt_ctx, pkt);
+        if (ret == AVERROR_EOF && bench) {
+            /* Loop the file until main_loop has encoded enough frames, unless
+             * a whole pass gave no picture: main_loop would wait forever */
+            if (!bench_pass_pics) {
+                jlog("error", "\"message\":\"Bench input has no decodable video\"");
+                g_running = 0;
+                break;
+            }
+            bench_pass_pics = 0;
+            loop_bg(&src);
+            continue;
+        }
         if (ret < 0) {
-            jlog("srt_dropped", "\"reason\":\"read_error\"");
             close_source(&src);
-            pthread_mutex_lock(&sh->lock);
-            sh->connected = 0;
-            sh->has_video = 0;
-            pthread_mutex_unlock(&sh->lock);
+            srt_set_dropped(sh, "read_error");
             continue;
         }
+        atomic_fetch_add_explicit(&app->metrics.srt_bytes, pkt->size, memory_order_relaxed);
 
         if (pkt->stream_index == src.video_stream_idx && src.video_dec_ctx) {
+            int64_t read_us = av_gettime();
+            pthread_mutex_lock(&sh->lock);
+            sh->video_received++;
+            pthread_mutex_unlock(&sh->lock);
             ret = avcodec_send_packet(src.video_dec_ctx, pkt);
             if (ret >= 0) {
                 ret = avcodec_receive_frame(src.video_dec_ctx, raw);
+                int flags = atomic_load(&app->sws_flags);
+                if (ret >= 0 && flags != src.sws_flags)
+                    source_scaler(&src, flags);
                 if (ret >= 0 && src.sws_ctx) {
+                    TRACE_BEGIN(tr_sws);
                     sws_scale(src.sws_ctx,
                         (const uint8_t *const *)raw->data, raw->linesize,
                         0, raw->height, tmp_data, tmp_linesize);
-                    pthread_mutex_lock(&sh->lock);
-                    av_image_copy(sh->video_data, sh->video_linesize,
-                                  (const uint8_t **)tmp_data, tmp_linesize,
-                                  AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
-                    sh->has_video = 1;
-                    sh->last_frame_time = av_gettime_relative();
-                    pthread_mutex_unlock(&sh->lock);
+                    TRACE_END(tr_sws, "sws_scale_srt");
+                    int64_t sent_us = g_cfg.latency_probe ?
+                        probe_read(tmp_data[0], tmp_linesize[0], g_cfg.out_width) : 0;
+                    TRACE_BEGIN(tr_pub);
+                    srt_publish_video(sh, tmp_data, tmp_linesize, sent_us, read_us, bench);
+                    TRACE_END(tr_pub, "srt_publish");
+                    bench_pass_pics++;
                 }
             }
         } else if (pkt->stream_index == src.audio_stream_idx &&
@@ -317,12 +998,8 @@ static void *srt_thread_func(void *arg) {
                                          AV_SAMPLE_FMT_FLTP, 0);
                         int conv = swr_convert(src.swr_ctx, obuf, out_samples,
                                     (const uint8_t **)raw->data, raw->nb_samples);
-                        if (conv > 0) {
-                            pthread_mutex_lock(&sh->lock);
-                            av_audio_fifo_write(sh->audio_fifo, (void **)obuf, conv);
-                            sh->last_frame_time = av_gettime_relative();
-                            pthread_mutex_unlock(&sh->lock);
-                        }
+                        if (conv > 0)
+                            srt_publish_audio(sh, obuf, conv);
                         av_freep(&obuf[0]);
                     }
                 }
@@ -330,19 +1007,19 @@ static void *srt_thread_func(void *arg) {
         }
         av_packet_unref(pkt);
 
-        pthread_mutex_lock(&sh->lock);
-        int64_t elapsed = av_gettime_relative() - sh->last_frame_time;
-        pthread_mutex_unlock(&sh->lock);
-        if (elapsed > g_cfg.srt_timeout_us) {
-            jlog("srt_dropped", "\"reason\":\"timeout\"");
+        if (!bench && srt_timed_out(sh)) {
             close_source(&src);
-            pthread_mutex_lock(&sh->lock);
-            sh->connected = 0;
-            sh->has_video = 0;
-            pthread_mutex_unlock(&sh->lock);
+            srt_set_dropped(sh, "timeout");
         }
     }
 
+    /* In bench mode main_loop may be waiting for a picture that will never
+     * come (SIGINT, bad input): wake it so it sees g_running and returns */
+    pthread_mutex_lock(&sh->lock);
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+
+    sh->cpu_ns = thread_cpu_ns();
     close_source(&src);
     av_freep(&tmp_data[0]);
     av_packet_free(&pkt);
@@ -350,6 +1027,66 @@ static void *srt_thread_func(void *arg) {
     return NULL;
 }
 
+/* Connection state and publishing, shared by the SRT thread and the
+ * --simulate sender. Times come from clock_us() so a simulated timeout
+ * follows the virtual clock. */
+static void srt_set_connected(SrtShared *sh) {
+    pthread_mutex_lock(&sh->lock);
+    sh->connected = 1;
+    sh->connects++;
+    sh->last_frame_time = clock_us();
+    sh->has_video = 0;
+    av_audio_fifo_reset(sh->audio_fifo);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void srt_set_dropped(SrtShared *sh, const char *reason) {
+    char extra[64];
+    snprintf(extra, sizeof(extra), "\"reason\":\"%s\"", reason);
+    jlog("srt_dropped", extra);
+    pthread_mutex_lock(&sh->lock);
+    sh->connected = 0;
+    sh->has_video = 0;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static int srt_timed_out(SrtShared *sh) {
+    pthread_mutex_lock(&sh->lock);
+    int64_t elapsed = clock_us() - sh->last_frame_time;
+    pthread_mutex_unlock(&sh->lock);
+    return elapsed > g_cfg.srt_timeout_us;
+}
+
+/* Replace the shared picture. In bench mode wait until main_loop took
+ * the previous one instead of counting it as dropped. */
+static void srt_publish_video(SrtShared *sh, uint8_t *const data[4], const int linesize[4],
+                              int64_t sent_us, int64_t read_us, int bench) {
+    pthread_mutex_lock(&sh->lock);
+    while (bench && g_running && sh->has_video && sh->video_seq != sh->taken_seq)
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    if (sh->has_video && sh->video_seq != sh->taken_seq)
+        sh->video_dropped++;
+    sh->video_decoded++;
+    av_image_copy(sh->video_data, sh->video_linesize,
+                  (const uint8_t **)data, linesize,
+                  AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
+    sh->has_video = 1;
+    sh->video_seq++;
+    sh->last_frame_time = clock_us();
+    sh->probe = (ProbeMark){ .sent_us = sent_us, .read_us = read_us,
+                             .decoded_us = sent_us ? av_gettime() : 0 };
+    if (bench)
+        pthread_cond_signal(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void srt_publish_audio(SrtShared *sh, uint8_t **buf, int samples) {
+    pthread_mutex_lock(&sh->lock);
+    av_audio_fifo_write(sh->audio_fifo, (void **)buf, samples);
+    sh->last_frame_time = clock_us();
+    pthread_mutex_unlock(&sh->lock);
+}
+
 /* ================================================================== */
 /*  open_output — FLV to stdout                                        */
 /* ================================================================== */
@@ -360,24 +1097,10 @@ static int open_output(AppState *app) {
     if ((ret = avformat_alloc_output_context2(&o->fmt_ctx, NULL, "flv", "pipe:1")) < 0)
         return ret;
 
-    const AVCodec *vc = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!vc) { jlog("error", "\"message\":\"No H264 encoder\""); return -1; }
-    o->video_enc_ctx = avcodec_alloc_context3(vc);
-    o->video_enc_ctx->width        = g_cfg.out_width;
-    o->video_enc_ctx->height       = g_cfg.out_height;
-    o->video_enc_ctx->time_base    = (AVRational){1, g_cfg.out_fps};
-    o->video_enc_ctx->framerate    = (AVRational){g_cfg.out_fps, 1};
-    o->video_enc_ctx->pix_fmt      = AV_PIX_FMT_YUV420P;
-    o->video_enc_ctx->gop_size     = g_cfg.out_fps * 2;
-    o->video_enc_ctx->max_b_frames = 0;
-    o->video_enc_ctx->bit_rate     = g_cfg.video_bitrate;
-    o->video_enc_ctx->thread_count = 4;
-    av_opt_set(o->video_enc_ctx->priv_data, "preset",  "ultrafast",   0);
-    av_opt_set(o->video_enc_ctx->priv_data, "tune",    "zerolatency", 0);
-    av_opt_set(o->video_enc_ctx->priv_data, "profile", "main",        0);
-    if (o->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-        o->video_enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    if ((ret = avcodec_open2(o->video_enc_ctx, vc, NULL)) < 0) return ret;
+    if (!(o->video_enc_ctx = open_video_encoder(o, NULL))) {
+        jlog("error", "\"message\":\"Cannot open H264 encoder\"");
+        return -1;
+    }
     o->video_stream = avformat_new_stream(o->fmt_ctx, NULL);
     avcodec_parameters_from_context(o->video_stream->codecpar, o->video_enc_ctx);
     o->video_stream->time_base = o->video_enc_ctx->time_base;
@@ -398,122 +1121,2715 @@ static int open_output(AppState *app) {
     avcodec_parameters_from_context(o->audio_stream->codecpar, o->audio_enc_ctx);
     o->audio_stream->time_base = o->audio_enc_ctx->time_base;
 
-    if ((ret = avio_open(&o->fmt_ctx->pb, "pipe:1", AVIO_FLAG_WRITE)) < 0) return ret;
+    const char *sink = g_cfg.null_output ? "/dev/null" : "pipe:1";
+    if ((ret = avio_open(&o->fmt_ctx->pb, sink, AVIO_FLAG_WRITE)) < 0) return ret;
     if ((ret = avformat_write_header(o->fmt_ctx, NULL)) < 0) return ret;
+
+    /* Muxing happens on its own thread so a stalled relay only fills the
+     * queue instead of blocking main_loop inside av_interleaved_write_frame */
+    if ((ret = pq_init(&o->queue, 1024, (int64_t)g_cfg.out_queue_kb * 1024,
+                       o->video_stream->index)) < 0) return ret;
+    if (pthread_create(&o->mux_thread, NULL, mux_thread_func, o) != 0) return -1;
+    o->mux_running = 1;
+
+    o->rec.fd = -1;
+    if (g_cfg.record_path[0] && open_recorder(o) < 0)
+        jlog("recording_failed", "\"message\":\"Cannot open recording\"");
+    if (g_cfg.shm_ring_path[0] && shm_ring_open(o) < 0)
+        jlog("error", "\"message\":\"Cannot create shared-memory ring\"");
+
     o->video_pts = o->audio_pts = 0;
+    rate_init(o);
+    o->last_key_pts    = 0;
+    o->idr_request_pts = -1;
+    o->idr_min_frames  = (int64_t)lrint(g_cfg.idr_min_interval * av_q2d(g_cfg.out_rate));
+    if (g_cfg.delay_seconds > 0.0)
+        delay_set(o, g_cfg.delay_seconds);
+    o->replay.span_us   = (int64_t)(g_cfg.replay_seconds * 1e6);
+    o->replay.max_bytes = (int64_t)g_cfg.replay_max_kb * 1024;
 
-    char extra[256];
+    char extra[512];
     snprintf(extra, sizeof(extra),
-             "\"resolution\":\"%dx%d\",\"fps\":%d,\"vbr\":%d,\"abr\":%d",
-             g_cfg.out_width, g_cfg.out_height,
-             g_cfg.out_fps, g_cfg.video_bitrate, g_cfg.audio_bitrate);
+             "\"resolution\":\"%dx%d\",\"fps\":%d,\"frame_rate\":\"%d/%d\",\"vbr\":%d,\"abr\":%d,"
+             "\"profile\":\"%s\",\"preset\":\"%s\",\"rc\":\"%s\",\"gop\":%d",
+             g_cfg.out_width, g_cfg.out_height, g_cfg.out_fps,
+             g_cfg.out_rate.num, g_cfg.out_rate.den,
+             g_cfg.video_bitrate, g_cfg.audio_bitrate,
+             g_cfg.enc.name, g_cfg.enc.preset,
+             g_cfg.enc.rc_mode == RC_CRF ? "crf" : g_cfg.enc.rc_mode == RC_CBR ? "cbr" : "abr",
+             o->video_enc_ctx->gop_size);
     jlog("output_ready", extra);
     return 0;
 }
 
-/* ================================================================== */
-/*  Encode helpers                                                     */
-/* ================================================================== */
-static int encode_write_video(OutputCtx *o, AVFrame *frame) {
-    AVPacket *pkt = av_packet_alloc();
-    frame->pts = o->video_pts++;
-    frame->pict_type = AV_PICTURE_TYPE_NONE;
-    int ret = avcodec_send_frame(o->video_enc_ctx, frame);
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(o->video_enc_ctx, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
-        if (ret < 0) break;
-        pkt->stream_index = o->video_stream->index;
-        av_packet_rescale_ts(pkt, o->video_enc_ctx->time_base, o->video_stream->time_base);
-        av_interleaved_write_frame(o->fmt_ctx, pkt);
+/* Open the H.264 encoder from the active profile. x264_params may add
+ * tuning that leaves SPS/PPS alone (used when the governor reopens it). */
+static AVCodecContext *open_video_encoder(OutputCtx *o, const char *x264_params) {
+    const AVCodec *vc = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!vc) return NULL;
+    AVCodecContext *c = avcodec_alloc_context3(vc);
+    if (!c) return NULL;
+    c->width        = g_cfg.out_width;
+    c->height       = g_cfg.out_height;
+    c->time_base    = av_inv_q(g_cfg.out_rate);
+    c->framerate    = g_cfg.out_rate;
+    c->pix_fmt      = AV_PIX_FMT_YUV420P;
+    c->max_b_frames = 0;
+    apply_encoder_profile(c, &g_cfg.enc);
+    /* pict_type I on a source switch must give a real IDR, not a recovery point */
+    av_opt_set_int(c->priv_data, "forced-idr", 1, 0);
+    if (x264_params)
+        av_opt_set(c->priv_data, "x264-params", x264_params, 0);
+    if (o->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(c, vc, NULL) < 0) {
+        avcodec_free_context(&c);
+        return NULL;
     }
-    av_packet_free(&pkt);
-    return 0;
+    return c;
 }
 
-static int read_bg_frame(SourceCtx *s, AVFrame *scaled, AVAudioFifo *afifo) {
-    AVPacket *pkt = av_packet_alloc();
-    AVFrame  *raw = av_frame_alloc();
-    int result = 0;
-    int ret = av_read_frame(s->fmt_ctx, pkt);
-    if (ret < 0) { av_packet_free(&pkt); av_frame_free(&raw); return ret; }
+/* Drain the queue, stop the writer and finish the FLV stream */
+static void close_output(OutputCtx *o) {
+    if (o->mux_running) {
+        pq_close(&o->queue);
+        pthread_join(o->mux_thread, NULL);
+        o->mux_running = 0;
+    }
+    pq_free(&o->queue);
+    if (o->delay.fifo.count) {
+        /* Still under delay: never published, so it is discarded */
+        char extra[128];
+        snprintf(extra, sizeof(extra), "\"discarded_pkts\":%d,\"discarded_bytes\":%lld",
+                 o->delay.fifo.count, (long long)o->delay.fifo.bytes);
+        jlog("delay_discarded", extra);
+    }
+    fifo_free(&o->delay.fifo);
+    replay_close(&o->replay);
+    close_recorder(&o->rec);
+    shm_ring_close(&o->shm);
+    if (o->fmt_ctx) {
+        av_write_trailer(o->fmt_ctx);
+        avcodec_free_context(&o->video_enc_ctx);
+        avcodec_free_context(&o->audio_enc_ctx);
+        if (!(o->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&o->fmt_ctx->pb);
+        avformat_free_context(o->fmt_ctx);
+        o->fmt_ctx = NULL;
+    }
+}
 
-    if (pkt->stream_index == s->video_stream_idx && s->video_dec_ctx) {
-        if (avcodec_send_packet(s->video_dec_ctx, pkt) >= 0 &&
-            avcodec_receive_frame(s->video_dec_ctx, raw) >= 0) {
-            scaled->format = AV_PIX_FMT_YUV420P;
-            scaled->width = g_cfg.out_width;
-            scaled->height = g_cfg.out_height;
-            av_frame_get_buffer(scaled, 0);
-            av_frame_make_writable(scaled);
-            sws_scale(s->sws_ctx, (const uint8_t *const *)raw->data,
-                      raw->linesize, 0, raw->height, scaled->data, scaled->linesize);
-            result = 1;
-        }
-    } else if (pkt->stream_index == s->audio_stream_idx &&
-               s->audio_dec_ctx && s->swr_ctx) {
-        if (avcodec_send_packet(s->audio_dec_ctx, pkt) >= 0 &&
-            avcodec_receive_frame(s->audio_dec_ctx, raw) >= 0) {
-            int out_n = swr_get_out_samples(s->swr_ctx, raw->nb_samples);
-            if (out_n > 0) {
-                uint8_t *ob[2] = {0};
-                av_samples_alloc(ob, NULL, g_cfg.out_channels, out_n, AV_SAMPLE_FMT_FLTP, 0);
-                int c = swr_convert(s->swr_ctx, ob, out_n,
-                                    (const uint8_t **)raw->data, raw->nb_samples);
-                if (c > 0) av_audio_fifo_write(afifo, (void **)ob, c);
-                av_freep(&ob[0]);
-            }
-            result = 2;
+static void *mux_thread_func(void *arg) {
+    OutputCtx *o = (OutputCtx *)arg;
+    AVPacket *pkt;
+    int64_t enq_us;
+    TRACE_THREAD("mux");
+    while ((pkt = pq_pop(&o->queue, &enq_us)) != NULL) {
+        int64_t t0 = av_gettime_relative();
+        ProbeMark mark = {0};
+        if (pkt->opaque_ref && pkt->opaque_ref->size == sizeof(mark))
+            memcpy(&mark, pkt->opaque_ref->data, sizeof(mark));
+        TRACE_BEGIN(tr_mux);
+        if (pkt->stream_index < 0) {
+            /* End of a low-latency tick: push everything to the pipe now */
+            av_write_frame(o->fmt_ctx, NULL);
+            avio_flush(o->fmt_ctx->pb);
+            mux_lat_release(o, 1);
+        } else if (g_cfg.mux_mode == MUX_LOWLATENCY) {
+            mux_lat_add(o, pkt, enq_us);
+            av_write_frame(o->fmt_ctx, pkt);
+        } else {
+            mux_lat_add(o, pkt, enq_us);
+            av_interleaved_write_frame(o->fmt_ctx, pkt);
+            mux_lat_release(o, 0);
         }
+        av_packet_free(&pkt);
+        TRACE_END(tr_mux, "mux_write");
+        if (mark.sent_us)
+            probe_report(&mark, av_gettime());
+        int64_t busy = av_gettime_relative() - t0;
+        pthread_mutex_lock(&o->queue.lock);
+        o->mux_lat.busy_us += busy;
+        pthread_mutex_unlock(&o->queue.lock);
     }
-    av_frame_free(&raw);
-    av_packet_free(&pkt);
-    return result;
+    return NULL;
 }
 
-static void loop_bg(SourceCtx *s) {
-    avio_seek(s->fmt_ctx->pb, 0, SEEK_SET);
-    avformat_seek_file(s->fmt_ctx, -1, INT64_MIN, 0, INT64_MAX, 0);
+/* Track a packet handed to the muxer, keeping pend[] in dts order */
+static void mux_lat_add(OutputCtx *o, const AVPacket *pkt, int64_t enq_us) {
+    MuxLatency *m = &o->mux_lat;
+    if (m->count == MUX_PENDING) return;   /* can't happen with two live streams */
+    int64_t dts_us = av_rescale_q(pkt->dts, o->fmt_ctx->streams[pkt->stream_index]->time_base,
+                                  AV_TIME_BASE_Q);
+    int i = m->count++;
+    while (i > 0 && m->pend[i - 1].dts_us > dts_us) {
+        m->pend[i] = m->pend[i - 1];
+        i--;
+    }
+    m->pend[i].dts_us = dts_us;
+    m->pend[i].enq_us = enq_us;
+    m->pend[i].stream = pkt->stream_index;
+    m->per_stream[pkt->stream_index & 1]++;
+}
+
+/* Retire packets the muxer has released: everything when all, otherwise
+ * the earliest ones for as long as both streams have one buffered */
+static void mux_lat_release(OutputCtx *o, int all) {
+    MuxLatency *m = &o->mux_lat;
+    int64_t now = av_gettime_relative();
+    int done = 0;
+    while (done < m->count && (all || (m->per_stream[0] > 0 && m->per_stream[1] > 0))) {
+        int64_t lat = now - m->pend[done].enq_us;
+        m->per_stream[m->pend[done].stream & 1]--;
+        pthread_mutex_lock(&o->queue.lock);
+        m->sum_us += lat;
+        m->n++;
+        if (lat > m->max_us) m->max_us = lat;
+        pthread_mutex_unlock(&o->queue.lock);
+        done++;
+    }
+    if (done) {
+        memmove(m->pend, m->pend + done, sizeof(m->pend[0]) * (m->count - done));
+        m->count -= done;
+    }
+}
+
+/* Fan an encoded packet out to the local taps and, through the delay line
+ * when one is active, to the writer thread. Takes the packet's data
+ * reference; pkt itself stays owned by the caller. */
+static void output_packet(OutputCtx *o, AVPacket *pkt) {
+    atomic_fetch_add_explicit(&o->bytes_out[pkt->stream_index], pkt->size,
+                              memory_order_relaxed);
+    if (o->shm.active)
+        shm_ring_publish(&o->shm, pkt);
+    if (o->rec.running && !o->rec.failed) {
+        /* Shares the encoded buffer; no copy */
+        AVPacket *r = av_packet_clone(pkt);
+        if (r && pq_push(&o->rec.queue, r) && !o->rec.degraded) {
+            o->rec.degraded = 1;
+            jlog("recording_degraded", NULL);
+        }
+    }
+    if (o->replay.span_us)
+        replay_push(o, pkt);
+
+    AVPacket *q = av_packet_alloc();
+    if (!q) { av_packet_unref(pkt); return; }
+    av_packet_move_ref(q, pkt);
+
+    if (o->delay.active)
+        delay_push(o, q);
+    else
+        live_packet(o, q);
+}
+
+/* Queue a packet (taking ownership) for the FLV writer thread */
+static void live_packet(OutputCtx *o, AVPacket *q) {
+    if (g_cfg.mux_mode == MUX_LOWLATENCY) {
+        /* Held until output_flush_tick() so the tick goes out in dts order */
+        if (o->tick_count == FF_ARRAY_ELEMS(o->tick_pkts))
+            output_flush_tick(o);
+        o->tick_pkts[o->tick_count++] = q;
+        return;
+    }
+    /* Once video is being dropped, get the next keyframe as soon as allowed */
+    if (pq_push(&o->queue, q))
+        request_idr(o);
+}
+
+/* MUX_LOWLATENCY: queue this tick's video and audio packets in timestamp
+ * order, followed by a flush marker for the writer thread */
+static void output_flush_tick(OutputCtx *o) {
+    if (g_cfg.mux_mode != MUX_LOWLATENCY || o->tick_count == 0) return;
+
+    for (int i = 1; i < o->tick_count; i++) {
+        AVPacket *p = o->tick_pkts[i];
+        AVRational tb = o->fmt_ctx->streams[p->stream_index]->time_base;
+        int j = i;
+        while (j > 0) {
+            AVPacket *prev = o->tick_pkts[j - 1];
+            if (av_compare_ts(prev->dts, o->fmt_ctx->streams[prev->stream_index]->time_base,
+                              p->dts, tb) <= 0)
+                break;
+            o->tick_pkts[j] = prev;
+            j--;
+        }
+        o->tick_pkts[j] = p;
+    }
+
+    int drop_started = 0;
+    for (int i = 0; i < o->tick_count; i++)
+        drop_started |= pq_push(&o->queue, o->tick_pkts[i]);
+    o->tick_count = 0;
+    if (drop_started)
+        request_idr(o);
+
+    AVPacket *marker = av_packet_alloc();
+    if (marker) {
+        marker->stream_index = -1;
+        pq_push(&o->queue, marker);
+    }
+}
+
+/* ================================================================== */
+/*  Per-source rate control                                            */
+/*  libx264 re-reads bit_rate / rc_max_rate / rc_buffer_size before    */
+/*  every frame and calls x264_encoder_reconfig when they change, so   */
+/*  the rate can move without reopening the encoder or the stream.     */
+/* ================================================================== */
+
+#define RATE_RAMP_STEPS 8
+
+static void rate_init(OutputCtx *o) {
+    const EncoderProfile *p = &g_cfg.enc;
+    if (p->rc_mode == RC_CRF)
+        o->rate_full = p->maxrate;   /* only VBV can be lowered under CRF */
+    else
+        o->rate_full = p->bitrate > 0 ? p->bitrate : g_cfg.video_bitrate;
+    if (g_cfg.bg_video_bitrate <= 0 || g_cfg.bg_video_bitrate >= o->rate_full)
+        o->rate_full = 0;
+    o->rate_cur = o->rate_target = o->rate_full;
+    o->rate_next_step = 0;
+}
+
+/* Scale the profile's rate-control settings to rate (lock-free: only
+ * main_loop touches the encoder context) */
+static void rate_apply(OutputCtx *o, int rate) {
+    const EncoderProfile *p = &g_cfg.enc;
+    AVCodecContext *c = o->video_enc_ctx;
+    if (p->rc_mode != RC_CRF)
+        c->bit_rate = rate;
+    if (p->maxrate > 0) {
+        c->rc_max_rate    = (int64_t)p->maxrate * rate / o->rate_full;
+        c->rc_buffer_size = (int)((int64_t)p->bufsize * rate / o->rate_full);
+    }
+    o->rate_cur = rate;
+}
+
+/* Background on screen: ramp down to bg_video_bitrate in a few steps.
+ * SRT back: restore the full rate at once so its IDR has headroom. */
+static void rate_update(OutputCtx *o, int srt_on_screen) {
+    if (!o->rate_full) return;
+    int target = srt_on_screen ? o->rate_full : g_cfg.bg_video_bitrate;
+    if (target != o->rate_target) {
+        o->rate_target = target;
+        o->rate_next_step = o->video_pts;
+        char extra[96];
+        snprintf(extra, sizeof(extra), "\"target_bps\":%d,\"source\":\"%s\"",
+                 target, srt_on_screen ? "srt" : "bg");
+        jlog("bitrate", extra);
+    }
+    if (o->rate_cur == o->rate_target || o->video_pts < o->rate_next_step) return;
+
+    if (o->rate_target > o->rate_cur) {
+        rate_apply(o, o->rate_target);
+        return;
+    }
+    int step = (o->rate_full - g_cfg.bg_video_bitrate) / RATE_RAMP_STEPS;
+    int next = o->rate_cur - (step > 0 ? step : 1);
+    rate_apply(o, next < o->rate_target ? o->rate_target : next);
+    o->rate_next_step = o->video_pts +
+        (int64_t)lrint(g_cfg.bitrate_ramp * av_q2d(g_cfg.out_rate) / RATE_RAMP_STEPS);
+}
+
+/* ================================================================== */
+/*  Local recording — fragmented MP4 / MPEG-TS of the live packets     */
+/* ================================================================== */
+
+#define RECORD_IO_BUF (1 << 20)
+
+static int recorder_write_cb(void *opaque, uint8_t *buf, int size) {
+    Recorder *r = (Recorder *)opaque;
+    int done = 0;
+    while (done < size) {
+        ssize_t n = write(r->fd, buf + done, (size_t)(size - done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return AVERROR(errno);
+        }
+        done += (int)n;
+    }
+    r->bytes_written += size;
+    return size;
+}
+
+static int open_recorder(OutputCtx *o) {
+    Recorder *r = &o->rec;
+    int ret;
+
+    char path[2048];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    if (!strftime(path, sizeof(path), g_cfg.record_path, &tm))
+        snprintf(path, sizeof(path), "%s", g_cfg.record_path);
+
+    int is_ts = strcmp(g_cfg.record_format, "mpegts") == 0;
+    if ((ret = avformat_alloc_output_context2(&r->fmt_ctx, NULL,
+                                              is_ts ? "mpegts" : "mp4", path)) < 0)
+        return ret;
+
+    AVStream *src[2] = { o->video_stream, o->audio_stream };
+    for (int i = 0; i < 2; i++) {
+        AVStream *st = avformat_new_stream(r->fmt_ctx, NULL);
+        if (!st) return AVERROR(ENOMEM);
+        avcodec_parameters_copy(st->codecpar, src[i]->codecpar);
+        st->codecpar->codec_tag = 0;   /* FLV tags mean nothing to mp4/ts */
+        st->time_base = src[i]->time_base;
+        r->src_tb[src[i]->index] = src[i]->time_base;
+    }
+
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (r->fd < 0) return AVERROR(errno);
+    uint8_t *io_buf = av_malloc(RECORD_IO_BUF);
+    if (!io_buf) return AVERROR(ENOMEM);
+    r->fmt_ctx->pb = avio_alloc_context(io_buf, RECORD_IO_BUF, 1, r, NULL,
+                                        recorder_write_cb, NULL);
+    if (!r->fmt_ctx->pb) { av_free(io_buf); return AVERROR(ENOMEM); }
+    r->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    /* Fragment at every keyframe with an empty moov up front: a crash
+     * leaves a file that plays up to the last complete fragment */
+    AVDictionary *opts = NULL;
+    if (!is_ts)
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    ret = avformat_write_header(r->fmt_ctx, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        r->failed = 1;   /* no header: close_recorder must not write a trailer */
+        return ret;
+    }
+
+    if ((ret = pq_init(&r->queue, 4096, (int64_t)g_cfg.record_queue_kb * 1024,
+                       o->video_stream->index)) < 0) return ret;
+    if (pthread_create(&r->thread, NULL, recorder_thread_func, r) != 0) return -1;
+    r->running = 1;
+
+    char extra[2300];
+    snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"format\":\"%s\"",
+             path, is_ts ? "mpegts" : "mp4");
+    jlog("recording_started", extra);
+    return 0;
+}
+
+static void *recorder_thread_func(void *arg) {
+    Recorder *r = (Recorder *)arg;
+    AVPacket *pkt;
+    while ((pkt = pq_pop(&r->queue, NULL)) != NULL) {
+        if (!r->failed) {
+            AVStream *st = r->fmt_ctx->streams[pkt->stream_index];
+            av_packet_rescale_ts(pkt, r->src_tb[pkt->stream_index], st->time_base);
+            int ret = av_interleaved_write_frame(r->fmt_ctx, pkt);
+            if (ret < 0) {
+                char buf[128], extra[256];
+                av_strerror(ret, buf, sizeof(buf));
+                snprintf(extra, sizeof(extra), "\"message\":\"%s\"", buf);
+                jlog("recording_failed", extra);
+                r->failed = 1;
+            }
+        }
+        av_packet_free(&pkt);
+    }
+    return NULL;
+}
+
+/* Called once per stats interval: leave the degraded state once the
+ * writer has caught up and recording restarted on a keyframe */
+static void recorder_poll(Recorder *r) {
+    if (!r->running || !r->degraded) return;
+    pthread_mutex_lock(&r->queue.lock);
+    int recovered = !r->queue.waiting_key && r->queue.bytes < r->queue.max_bytes / 2;
+    pthread_mutex_unlock(&r->queue.lock);
+    if (recovered) {
+        r->degraded = 0;
+        jlog("recording_ok", NULL);
+    }
+}
+
+static void close_recorder(Recorder *r) {
+    if (r->running) {
+        pq_close(&r->queue);
+        pthread_join(r->thread, NULL);
+        r->running = 0;
+    }
+    pq_free(&r->queue);
+    if (r->fmt_ctx) {
+        if (r->fmt_ctx->pb) {
+            if (!r->failed) av_write_trailer(r->fmt_ctx);
+            avio_flush(r->fmt_ctx->pb);
+            av_freep(&r->fmt_ctx->pb->buffer);
+            avio_context_free(&r->fmt_ctx->pb);
+        }
+        avformat_free_context(r->fmt_ctx);
+        r->fmt_ctx = NULL;
+    }
+    if (r->fd >= 0) { close(r->fd); r->fd = -1; }
+}
+
+/* ================================================================== */
+/*  Shared-memory packet ring (layout documented in the header)        */
+/* ================================================================== */
+
+#define SHM_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+static int shm_ring_open(OutputCtx *o) {
+    ShmRing *r = &o->shm;
+    size_t hdr_size  = (size_t)SHM_ALIGN(sizeof(ShmRingHeader));
+    size_t data_size = (size_t)g_cfg.shm_ring_kb * 1024;
+
+    /* Build the ring in a new file and rename it over the path once it is
+     * set up: truncating the old file would SIGBUS a reader still mapped
+     * to it, and new readers never see a half-written header */
+    char tmp[sizeof(g_cfg.shm_ring_path) + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", g_cfg.shm_ring_path, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return AVERROR(errno);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)(hdr_size + data_size)) == 0)
+        map = mmap(NULL, hdr_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (map == MAP_FAILED) { unlink(tmp); return AVERROR(err); }
+
+    r->hdr      = map;
+    r->data     = (uint8_t *)map + hdr_size;
+    r->map_size = hdr_size + data_size;
+
+    ShmRingHeader *h = r->hdr;
+    h->version     = SHM_RING_VERSION;
+    h->header_size = (uint32_t)hdr_size;
+    h->data_size   = data_size;
+    h->width       = g_cfg.out_width;
+    h->height      = g_cfg.out_height;
+    h->sample_rate = g_cfg.sample_rate;
+    h->channels    = g_cfg.out_channels;
+    AVStream *st[2] = { o->video_stream, o->audio_stream };
+    for (int i = 0; i < 2; i++) {
+        h->tb_num[i] = st[i]->time_base.num;
+        h->tb_den[i] = st[i]->time_base.den;
+        int n = st[i]->codecpar->extradata_size;
+        if (n > (int)sizeof(h->extradata[i])) n = 0;
+        if (n > 0) memcpy(h->extradata[i], st[i]->codecpar->extradata, n);
+        h->extradata_size[i] = (uint32_t)n;
+    }
+    atomic_store(&h->write_pos, 0);
+    atomic_store(&h->last_key_pos, 0);
+    atomic_thread_fence(memory_order_release);
+    h->magic = SHM_RING_MAGIC;
+    if (rename(tmp, g_cfg.shm_ring_path) < 0) {
+        err = errno;
+        munmap(map, r->map_size);
+        unlink(tmp);
+        r->hdr = NULL;
+        return AVERROR(err);
+    }
+    r->active = 1;
+
+    char extra[1200];
+    snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"bytes\":%zu",
+             g_cfg.shm_ring_path, data_size);
+    jlog("shm_ring_ready", extra);
+    return 0;
+}
+
+/* Single writer; never waits for readers */
+static void shm_ring_publish(ShmRing *r, const AVPacket *pkt) {
+    ShmRingHeader *h = r->hdr;
+    uint64_t need = SHM_ALIGN(sizeof(ShmPktHeader) + (uint64_t)pkt->size);
+    if (need > h->data_size / 4) return;   /* absurd packet: skip rather than wipe the ring */
+
+    uint64_t pos = atomic_load_explicit(&h->write_pos, memory_order_relaxed);
+    uint64_t off = pos % h->data_size;
+    if (off + need > h->data_size) {
+        /* Pad to the end of the data area; readers jump to offset 0 */
+        if (h->data_size - off >= sizeof(ShmPktHeader)) {
+            ShmPktHeader pad = { 0 };
+            pad.stream = SHM_PAD;
+            memcpy(r->data + off, &pad, sizeof(pad));
+        }
+        pos += h->data_size - off;
+        off  = 0;
+    }
+
+    ShmPktHeader ph = {
+        .size     = (uint32_t)pkt->size,
+        .stream   = (uint32_t)pkt->stream_index,
+        .flags    = (pkt->flags & AV_PKT_FLAG_KEY) ? SHM_PKT_KEY : 0,
+        .seq      = atomic_load_explicit(&h->seq, memory_order_relaxed),
+        .pts      = pkt->pts,
+        .dts      = pkt->dts,
+        .duration = pkt->duration,
+    };
+    memcpy(r->data + off, &ph, sizeof(ph));
+    memcpy(r->data + off + sizeof(ph), pkt->data, pkt->size);
+
+    if (ph.stream == 0 && ph.flags & SHM_PKT_KEY)
+        atomic_store_explicit(&h->last_key_pos, pos, memory_order_release);
+    atomic_store_explicit(&h->seq, ph.seq + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->write_pos, pos + need, memory_order_release);
+
+    atomic_fetch_add_explicit(&h->doorbell, 1, memory_order_release);
+    if (atomic_load_explicit(&h->waiters, memory_order_acquire) > 0)
+        syscall(SYS_futex, &h->doorbell, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void shm_ring_close(ShmRing *r) {
+    if (!r->hdr) return;
+    atomic_store(&r->hdr->closed, 1);
+    atomic_fetch_add(&r->hdr->doorbell, 1);
+    syscall(SYS_futex, &r->hdr->doorbell, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    munmap(r->hdr, r->map_size);
+    unlink(g_cfg.shm_ring_path);
+    r->hdr = NULL;
+    r->active = 0;
+}
+
+/* ================================================================== */
+/*  Packet FIFO                                                        */
+/* ================================================================== */
+
+static int fifo_push(PktFifo *f, AVPacket *pkt) {
+    if (f->count == f->cap) {
+        int cap = f->cap ? f->cap * 2 : 256;
+        AVPacket **pkts = av_malloc_array(cap, sizeof(*pkts));
+        if (!pkts) return AVERROR(ENOMEM);
+        for (int i = 0; i < f->count; i++)
+            pkts[i] = f->pkts[(f->head + i) % f->cap];
+        av_free(f->pkts);
+        f->pkts = pkts;
+        f->cap  = cap;
+        f->head = 0;
+    }
+    f->pkts[(f->head + f->count) % f->cap] = pkt;
+    f->count++;
+    f->bytes += pkt->size;
+    return 0;
+}
+
+static AVPacket *fifo_peek(const PktFifo *f, int i) {
+    return i < f->count ? f->pkts[(f->head + i) % f->cap] : NULL;
+}
+
+static AVPacket *fifo_pop(PktFifo *f) {
+    if (f->count == 0) return NULL;
+    AVPacket *pkt = f->pkts[f->head];
+    f->head = (f->head + 1) % f->cap;
+    f->count--;
+    f->bytes -= pkt->size;
+    return pkt;
+}
+
+static void fifo_free(PktFifo *f) {
+    AVPacket *pkt;
+    while ((pkt = fifo_pop(f)) != NULL)
+        av_packet_free(&pkt);
+    av_freep(&f->pkts);
+    f->cap = f->head = 0;
+}
+
+/* ================================================================== */
+/*  Broadcast delay line                                               */
+/*  Holds encoded packets, so memory is bitrate x delay. The media     */
+/*  clock is the newest dts pushed: output is paced in real time, so a */
+/*  packet leaves once the live edge is delay_us past it.              */
+/* ================================================================== */
+
+static int64_t pkt_dts_us(const OutputCtx *o, const AVPacket *pkt) {
+    return av_rescale_q(pkt->dts, o->fmt_ctx->streams[pkt->stream_index]->time_base,
+                        AV_TIME_BASE_Q);
+}
+
+/* Request a new delay; it is reached at the next GOP boundary */
+static void delay_set(OutputCtx *o, double seconds) {
+    DelayLine *d = &o->delay;
+    if (seconds < 0.0) seconds = 0.0;
+    if (seconds > g_cfg.delay_max_seconds) seconds = g_cfg.delay_max_seconds;
+    d->target_us = (int64_t)(seconds * 1e6);
+    d->active = 1;
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "\"target\":%.3f,\"current\":%.3f",
+             d->target_us / 1e6, d->delay_us / 1e6);
+    jlog("delay_set", extra);
+}
+
+static void delay_push(OutputCtx *o, AVPacket *pkt) {
+    DelayLine *d = &o->delay;
+    int64_t t = pkt_dts_us(o, pkt);
+    if (fifo_push(&d->fifo, pkt) < 0) {
+        av_packet_free(&pkt);
+        return;
+    }
+    if (t > d->live_edge_us) d->live_edge_us = t;
+}
+
+/* Index of the first video packet at or after from, -1 if none */
+static int delay_next_video(const OutputCtx *o, int from) {
+    const PktFifo *f = &o->delay.fifo;
+    for (int i = from; i < f->count; i++)
+        if (fifo_peek(f, i)->stream_index == o->video_stream->index)
+            return i;
+    return -1;
+}
+
+/* Whether the next video packet to leave starts a GOP */
+static int delay_at_gop(const OutputCtx *o) {
+    int v = delay_next_video(o, 0);
+    return v >= 0 && (fifo_peek(&o->delay.fifo, v)->flags & AV_PKT_FLAG_KEY);
+}
+
+/* Shorten the delay by cutting whole GOPs from the head of the line:
+ * up to the latest keyframe that removes no more than the excess, so the
+ * delay never undershoots its target. Later packets are shifted back by
+ * the cut span. Less than one GOP of excess stays buffered. */
+static void delay_drain(OutputCtx *o) {
+    DelayLine *d = &o->delay;
+    if (!delay_at_gop(o)) return;
+    int first = delay_next_video(o, 0);
+    if (first < 0) return;
+
+    int64_t head_us = pkt_dts_us(o, fifo_peek(&d->fifo, first));
+    int64_t limit   = head_us + (d->delay_us - d->target_us);
+    int cut = -1;
+    for (int i = delay_next_video(o, first + 1); i >= 0; i = delay_next_video(o, i + 1)) {
+        AVPacket *p = fifo_peek(&d->fifo, i);
+        if (pkt_dts_us(o, p) > limit) break;
+        if (p->flags & AV_PKT_FLAG_KEY) cut = i;
+    }
+    if (cut < 0) return;
+
+    /* Audio encoded in the same tick as the keyframe may sit just after it
+     * with an earlier dts; it belongs to the cut span too */
+    int64_t cut_us = pkt_dts_us(o, fifo_peek(&d->fifo, cut));
+    int n = d->fifo.count;
+    for (int i = 0; i < n; i++) {
+        AVPacket *p = fifo_pop(&d->fifo);
+        if (i < cut || pkt_dts_us(o, p) < cut_us)
+            av_packet_free(&p);
+        else
+            fifo_push(&d->fifo, p);   /* order kept; cannot grow */
+    }
+
+    int64_t span = cut_us - head_us;
+    d->offset_us += span;
+    d->delay_us  -= span;
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "\"cut\":%.3f,\"current\":%.3f,\"target\":%.3f",
+             span / 1e6, d->delay_us / 1e6, d->target_us / 1e6);
+    jlog("delay_drained", extra);
+}
+
+/* Hand every packet whose delay has elapsed to the writer thread */
+static void delay_release(OutputCtx *o) {
+    DelayLine *d = &o->delay;
+    if (!d->active) return;
+    if (d->target_us < d->delay_us)
+        delay_drain(o);
+
+    AVPacket *pkt;
+    while ((pkt = fifo_peek(&d->fifo, 0)) != NULL) {
+        if (d->target_us > d->delay_us && delay_at_gop(o)) {
+            /* Output pauses here, after a whole GOP, until the line is deeper */
+            d->delay_us = d->target_us;
+            char extra[64];
+            snprintf(extra, sizeof(extra), "\"current\":%.3f", d->delay_us / 1e6);
+            jlog("delay_grown", extra);
+        }
+        if (pkt_dts_us(o, pkt) + d->delay_us > d->live_edge_us) break;
+
+        fifo_pop(&d->fifo);
+        if (d->offset_us) {
+            int64_t off = av_rescale_q(d->offset_us, AV_TIME_BASE_Q,
+                                       o->fmt_ctx->streams[pkt->stream_index]->time_base);
+            pkt->pts -= off;
+            pkt->dts -= off;
+        }
+        live_packet(o, pkt);
+    }
+}
+
+/* ================================================================== */
+/*  Instant replay — GOP-aligned ring of the newest encoded packets    */
+/* ================================================================== */
+
+/* Keep a reference to a live packet (shares the encoded buffer) */
+static void replay_push(OutputCtx *o, const AVPacket *pkt) {
+    ReplayRing *r = &o->replay;
+    int is_key = pkt->stream_index == o->video_stream->index &&
+                 (pkt->flags & AV_PKT_FLAG_KEY);
+    if (r->fifo.count == 0 && !is_key) return;   /* clips start on a keyframe */
+
+    AVPacket *c = av_packet_clone(pkt);
+    if (!c || fifo_push(&r->fifo, c) < 0) { av_packet_free(&c); return; }
+    int64_t t = pkt_dts_us(o, pkt);
+    if (t > r->newest_us) r->newest_us = t;
+    if (is_key && ++r->gops == 2) r->next_gop_us = t;
+
+    while (r->gops > 1 && (r->fifo.bytes > r->max_bytes ||
+                           r->newest_us - r->next_gop_us >= r->span_us))
+        replay_drop_gop(o);
+    if (r->fifo.bytes > r->max_bytes) {
+        /* A single GOP over budget: start again at the next keyframe */
+        AVPacket *p;
+        while ((p = fifo_pop(&r->fifo)) != NULL) av_packet_free(&p);
+        r->gops = 0;
+    }
+}
+
+/* Drop the oldest GOP, leaving the ring on the next keyframe */
+static void replay_drop_gop(OutputCtx *o) {
+    ReplayRing *r = &o->replay;
+    AVPacket *p = fifo_pop(&r->fifo);
+    av_packet_free(&p);
+    while ((p = fifo_peek(&r->fifo, 0)) != NULL &&
+           !(p->stream_index == o->video_stream->index && (p->flags & AV_PKT_FLAG_KEY))) {
+        fifo_pop(&r->fifo);
+        av_packet_free(&p);
+    }
+    r->gops--;
+    for (int i = 1; i < r->fifo.count; i++) {
+        p = fifo_peek(&r->fifo, i);
+        if (p->stream_index == o->video_stream->index && (p->flags & AV_PKT_FLAG_KEY)) {
+            r->next_gop_us = pkt_dts_us(o, p);
+            break;
+        }
+    }
+}
+
+/* Start exporting the last `seconds` (from the latest keyframe at or
+ * before that point) to path, or to replay_path when path is empty.
+ * Fills reply with a one-line JSON result. */
+static int replay_clip(OutputCtx *o, double seconds, const char *path,
+                       char *reply, size_t size) {
+    ReplayRing *r = &o->replay;
+    const char *err = NULL;
+    if (!r->span_us)                     err = "replay buffer disabled";
+    else if (atomic_load(&r->busy))      err = "clip export already running";
+    else if (r->fifo.count == 0)         err = "replay buffer empty";
+    else if (strpbrk(path, "\"\\"))      err = "bad path";
+    if (err) {
+        snprintf(reply, size, "{\"ok\":false,\"error\":\"%s\"}\n", err);
+        return -1;
+    }
+    if (r->joinable) {
+        pthread_join(r->thread, NULL);
+        r->joinable = 0;
+    }
+
+    int64_t want = r->newest_us - (int64_t)(seconds * 1e6);
+    int start = 0;
+    for (int i = 1; i < r->fifo.count; i++) {
+        AVPacket *p = fifo_peek(&r->fifo, i);
+        if (p->stream_index != o->video_stream->index || !(p->flags & AV_PKT_FLAG_KEY))
+            continue;
+        if (pkt_dts_us(o, p) > want) break;
+        start = i;
+    }
+
+    ReplayJob *job = av_mallocz(sizeof(*job));
+    if (!job) goto nomem;
+    job->ring = r;
+    job->pkts = av_malloc_array(r->fifo.count - start, sizeof(*job->pkts));
+    if (!job->pkts) goto nomem;
+    int64_t bytes = 0;
+    for (int i = start; i < r->fifo.count; i++) {
+        AVPacket *c = av_packet_clone(fifo_peek(&r->fifo, i));
+        if (!c) goto nomem;
+        job->pkts[job->count++] = c;
+        bytes += c->size;
+    }
+    AVStream *src[2] = { o->video_stream, o->audio_stream };
+    for (int i = 0; i < 2; i++) {
+        int idx = src[i]->index;
+        if (!(job->par[idx] = avcodec_parameters_alloc())) goto nomem;
+        avcodec_parameters_copy(job->par[idx], src[i]->codecpar);
+        job->par[idx]->codec_tag = 0;
+        job->tb[idx] = src[i]->time_base;
+    }
+    job->start_us = pkt_dts_us(o, job->pkts[0]);
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    const char *pattern = *path ? path : g_cfg.replay_path;
+    if (!strftime(job->path, sizeof(job->path), pattern, &tm))
+        snprintf(job->path, sizeof(job->path), "%s", pattern);
+
+    atomic_store(&r->busy, 1);
+    if (pthread_create(&r->thread, NULL, replay_thread_func, job) != 0) {
+        atomic_store(&r->busy, 0);
+        goto nomem;
+    }
+    r->joinable = 1;
+    r->clips++;
+
+    snprintf(reply, size, "{\"ok\":true,\"path\":\"%s\",\"seconds\":%.3f,\"bytes\":%lld}\n",
+             job->path, (r->newest_us - job->start_us) / 1e6, (long long)bytes);
+    return 0;
+
+nomem:
+    replay_job_free(job);
+    snprintf(reply, size, "{\"ok\":false,\"error\":\"cannot start clip export\"}\n");
+    return -1;
+}
+
+/* Write the clip to <path>.part and rename it into place when complete */
+static void *replay_thread_func(void *arg) {
+    ReplayJob *job = (ReplayJob *)arg;
+    char tmp[2100];
+    snprintf(tmp, sizeof(tmp), "%s.part", job->path);
+
+    AVFormatContext *fc = NULL;
+    int64_t bytes = 0;
+    int ret = avformat_alloc_output_context2(&fc, NULL, "mp4", tmp);
+    for (int i = 0; ret >= 0 && i < 2; i++) {
+        AVStream *st = avformat_new_stream(fc, NULL);
+        if (!st) { ret = AVERROR(ENOMEM); break; }
+        avcodec_parameters_copy(st->codecpar, job->par[i]);
+        st->time_base = job->tb[i];
+    }
+    if (ret >= 0)
+        ret = avio_open(&fc->pb, tmp, AVIO_FLAG_WRITE);
+    if (ret >= 0) {
+        AVDictionary *opts = NULL;
+        av_dict_set(&opts, "movflags", "faststart", 0);
+        ret = avformat_write_header(fc, &opts);
+        av_dict_free(&opts);
+    }
+    for (int i = 0; ret >= 0 && i < job->count; i++) {
+        AVPacket *p = job->pkts[i];
+        int idx = p->stream_index;
+        if (av_rescale_q(p->dts, job->tb[idx], AV_TIME_BASE_Q) < job->start_us)
+            continue;   /* audio from before the first keyframe */
+        int64_t base = av_rescale_q(job->start_us, AV_TIME_BASE_Q, job->tb[idx]);
+        p->pts -= base;
+        p->dts -= base;
+        av_packet_rescale_ts(p, job->tb[idx], fc->streams[idx]->time_base);
+        bytes += p->size;
+        ret = av_interleaved_write_frame(fc, p);
+    }
+    if (ret >= 0)
+        ret = av_write_trailer(fc);
+    if (fc) {
+        if (fc->pb) avio_closep(&fc->pb);
+        avformat_free_context(fc);
+    }
+    if (ret >= 0 && rename(tmp, job->path) < 0)
+        ret = AVERROR(errno);
+
+    char extra[2400];
+    if (ret >= 0) {
+        snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"bytes\":%lld", job->path,
+                 (long long)bytes);
+        jlog("replay_saved", extra);
+    } else {
+        char buf[128];
+        av_strerror(ret, buf, sizeof(buf));
+        unlink(tmp);
+        snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"message\":\"%s\"", job->path, buf);
+        jlog("replay_failed", extra);
+    }
+
+    ReplayRing *r = job->ring;
+    replay_job_free(job);
+    atomic_store(&r->busy, 0);
+    return NULL;
+}
+
+static void replay_job_free(ReplayJob *job) {
+    if (!job) return;
+    for (int i = 0; i < job->count; i++)
+        av_packet_free(&job->pkts[i]);
+    av_freep(&job->pkts);
+    avcodec_parameters_free(&job->par[0]);
+    avcodec_parameters_free(&job->par[1]);
+    av_free(job);
+}
+
+/* Let a running export finish, then release the ring */
+static void replay_close(ReplayRing *r) {
+    if (r->joinable) {
+        pthread_join(r->thread, NULL);
+        r->joinable = 0;
+    }
+    fifo_free(&r->fifo);
+    r->gops = 0;
+}
+
+/* ================================================================== */
+/*  Thumbnail tap — small JPEG of out_frame for the dashboard          */
+/* ================================================================== */
+
+static int thumb_open(ThumbTap *t) {
+    int w = g_cfg.thumb_width & ~1;
+    int h = (int)av_rescale(w, g_cfg.out_height, g_cfg.out_width) & ~1;
+    if (w < 16 || h < 16) return -1;
+
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) return -1;
+    t->enc = avcodec_alloc_context3(codec);
+    if (!t->enc) return -1;
+    t->enc->width         = w;
+    t->enc->height        = h;
+    t->enc->pix_fmt       = AV_PIX_FMT_YUVJ420P;
+    t->enc->time_base     = (AVRational){1, 1};
+    t->enc->flags        |= AV_CODEC_FLAG_QSCALE;
+    t->enc->global_quality = FF_QP2LAMBDA * 5;
+    if (avcodec_open2(t->enc, codec, NULL) < 0) return -1;
+
+    t->small = av_frame_alloc();
+    t->pkt   = av_packet_alloc();
+    if (!t->small || !t->pkt) return -1;
+    t->small->format = AV_PIX_FMT_YUVJ420P;
+    t->small->width  = w;
+    t->small->height = h;
+    if (av_frame_get_buffer(t->small, 0) < 0) return -1;
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, thumb_thread_func, t) != 0) return -1;
+    t->running = 1;
+    return 0;
+}
+
+/* Called once per tick. Only takes a reference: the next write to
+ * out_frame goes through av_frame_make_writable(), which copies while the
+ * thread still holds it, so at most one picture copy per capture. */
+static void thumb_capture(ThumbTap *t, const AVFrame *frame, int64_t video_pts) {
+    if (!t->running || video_pts < t->next_pts || !frame->buf[0]) return;
+    t->next_pts = video_pts + (int64_t)lrint(g_cfg.thumb_interval * av_q2d(g_cfg.out_rate));
+
+    pthread_mutex_lock(&t->lock);
+    if (!t->pending) {   /* previous one still encoding: skip this capture */
+        AVFrame *ref = av_frame_alloc();
+        if (ref && av_frame_ref(ref, frame) == 0) {
+            t->pending = ref;
+            pthread_cond_signal(&t->cond);
+        } else {
+            av_frame_free(&ref);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void *thumb_thread_func(void *arg) {
+    ThumbTap *t = (ThumbTap *)arg;
+    /* Background work: never compete with the encode loop for a core */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (!t->pending && !t->stop)
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (!t->pending) break;
+        AVFrame *frame = t->pending;
+        pthread_mutex_unlock(&t->lock);
+
+        t->sws = sws_getCachedContext(t->sws, frame->width, frame->height, frame->format,
+                                      t->small->width, t->small->height, AV_PIX_FMT_YUVJ420P,
+                                      SWS_BILINEAR, NULL, NULL, NULL);
+        int ret = -1;
+        if (t->sws) {
+            sws_scale(t->sws, (const uint8_t *const *)frame->data, frame->linesize,
+                      0, frame->height, t->small->data, t->small->linesize);
+            ret = thumb_write(t);
+        }
+        if (ret < 0) {
+            char extra[2300];
+            snprintf(extra, sizeof(extra), "\"path\":\"%s\"", g_cfg.thumb_path);
+            jlog("thumb_failed", extra);
+        } else if (t->written++ == 0) {
+            char extra[2300];
+            snprintf(extra, sizeof(extra), "\"path\":\"%s\",\"size\":\"%dx%d\"",
+                     g_cfg.thumb_path, t->small->width, t->small->height);
+            jlog("thumb_ready", extra);
+        }
+
+        pthread_mutex_lock(&t->lock);
+        av_frame_free(&t->pending);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* Encode t->small and replace thumb_path atomically (write + rename) */
+static int thumb_write(ThumbTap *t) {
+    t->small->pts = t->written;
+    if (avcodec_send_frame(t->enc, t->small) < 0) return -1;
+    if (avcodec_receive_packet(t->enc, t->pkt) < 0) return -1;
+
+    char tmp[2100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_cfg.thumb_path);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(t->pkt->data, 1, t->pkt->size, f) == (size_t)t->pkt->size;
+    if (f && fclose(f) != 0) ok = 0;
+    av_packet_unref(t->pkt);
+    if (!ok || rename(tmp, g_cfg.thumb_path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void thumb_close(ThumbTap *t) {
+    if (t->running) {
+        pthread_mutex_lock(&t->lock);
+        t->stop = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->thread, NULL);
+        t->running = 0;
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+    }
+    av_frame_free(&t->pending);
+    avcodec_free_context(&t->enc);
+    sws_freeContext(t->sws);
+    t->sws = NULL;
+    av_frame_free(&t->small);
+    av_packet_free(&t->pkt);
+}
+
+/* ================================================================== */
+/*  Control socket — one command per datagram, polled every tick       */
+/*  e.g. echo "delay 15" | socat - UNIX-SENDTO:/run/ree/ctl.sock       */
+/* ================================================================== */
+
+static int control_open(AppState *app) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_cfg.control_socket);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    app->ctl_fd = fd;
+    jlog("control_ready", NULL);
+    return 0;
+}
+
+/* Serve pending commands without blocking. Senders that bound an address
+ * of their own get a one-line JSON reply. */
+static void control_poll(AppState *app) {
+    if (app->ctl_fd < 0) return;
+    for (int i = 0; i < 8; i++) {
+        char cmd[2560], reply[2560];
+        struct sockaddr_un from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(app->ctl_fd, cmd, sizeof(cmd) - 1, 0,
+                             (struct sockaddr *)&from, &from_len);
+        if (n < 0) break;
+        cmd[n] = '\0';
+        cmd[strcspn(cmd, "\r\n")] = '\0';
+        control_exec(app, cmd, reply, sizeof(reply));
+        if (from_len > sizeof(sa_family_t))
+            sendto(app->ctl_fd, reply, strlen(reply), MSG_DONTWAIT,
+                   (struct sockaddr *)&from, from_len);
+    }
+}
+
+static void control_exec(AppState *app, const char *cmd, char *reply, size_t size) {
+    char verb[32] = "";
+    int args = 0;
+    sscanf(cmd, "%31s %n", verb, &args);
+    const char *arg = cmd + args;
+
+    if (strcmp(verb, "delay") == 0) {
+        DelayLine *d = &app->out.delay;
+        if (*arg) {
+            char *end;
+            double secs = strtod(arg, &end);
+            if (end == arg || secs < 0.0 || secs > g_cfg.delay_max_seconds) {
+                snprintf(reply, size, "{\"ok\":false,\"error\":\"delay must be 0..%.0f\"}\n",
+                         g_cfg.delay_max_seconds);
+                return;
+            }
+            delay_set(&app->out, secs);
+        }
+        snprintf(reply, size,
+                 "{\"ok\":true,\"delay\":%.3f,\"target\":%.3f,\"buffered_bytes\":%lld}\n",
+                 d->delay_us / 1e6, d->target_us / 1e6, (long long)d->fifo.bytes);
+        return;
+    }
+    if (strcmp(verb, "replay") == 0) {
+        /* replay [seconds [path]] */
+        double secs = g_cfg.replay_seconds;
+        const char *path = "";
+        if (*arg) {
+            char *end;
+            secs = strtod(arg, &end);
+            if (end == arg || secs <= 0.0) {
+                snprintf(reply, size, "{\"ok\":false,\"error\":\"bad duration\"}\n");
+                return;
+            }
+            path = end + strspn(end, " \t");
+        }
+        replay_clip(&app->out, secs, path, reply, size);
+        return;
+    }
+    snprintf(reply, size, "{\"ok\":false,\"error\":\"unknown command\"}\n");
+}
+
+static void control_close(AppState *app) {
+    if (app->ctl_fd < 0) return;
+    close(app->ctl_fd);
+    unlink(g_cfg.control_socket);
+    app->ctl_fd = -1;
+}
+
+/* ================================================================== */
+/*  Packet queue                                                       */
+/* ================================================================== */
+
+static int pq_init(PacketQueue *q, int cap, int64_t max_bytes, int video_idx) {
+    memset(q, 0, sizeof(*q));
+    q->pkts   = av_mallocz(sizeof(*q->pkts) * cap);
+    q->enq_us = av_mallocz(sizeof(*q->enq_us) * cap);
+    if (!q->pkts || !q->enq_us) { av_freep(&q->pkts); av_freep(&q->enq_us); return AVERROR(ENOMEM); }
+    q->cap       = cap;
+    q->max_bytes = max_bytes;
+    q->video_idx = video_idx;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    return 0;
+}
+
+static void pq_free(PacketQueue *q) {
+    if (!q->pkts) return;
+    for (int i = 0; i < q->count; i++)
+        av_packet_free(&q->pkts[(q->head + i) % q->cap]);
+    av_freep(&q->pkts);
+    av_freep(&q->enq_us);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+/* Remove every queued video packet (lock held). The GOP they belong to
+ * can't be completed once anything has been dropped. */
+static void pq_drop_video(PacketQueue *q) {
+    int kept = 0;
+    for (int i = 0; i < q->count; i++) {
+        int slot = (q->head + i) % q->cap;
+        AVPacket *p = q->pkts[slot];
+        if (p->stream_index == q->video_idx) {
+            q->bytes -= p->size;
+            q->dropped_video++;
+            av_packet_free(&p);
+        } else {
+            int to = (q->head + kept++) % q->cap;
+            q->pkts[to]   = p;
+            q->enq_us[to] = q->enq_us[slot];
+        }
+    }
+    q->count = kept;
+}
+
+/* Never blocks. Returns 1 when this push started a video drop run. */
+static int pq_push(PacketQueue *q, AVPacket *pkt) {
+    int is_video = pkt->stream_index == q->video_idx;
+    int is_key   = pkt->flags & AV_PKT_FLAG_KEY;
+    int started  = 0;
+
+    pthread_mutex_lock(&q->lock);
+    /* Flush markers (stream_index < 0) are never worth making room for */
+    if (q->closed || (pkt->stream_index < 0 && q->count == q->cap)) {
+        pthread_mutex_unlock(&q->lock);
+        av_packet_free(&pkt);
+        return 0;
+    }
+    if (is_video && q->waiting_key) {
+        if (!is_key) {
+            q->dropped_video++;
+            pthread_mutex_unlock(&q->lock);
+            av_packet_free(&pkt);
+            return 0;
+        }
+        q->waiting_key = 0;
+    }
+
+    if (q->count == q->cap || q->bytes + pkt->size > q->max_bytes) {
+        pq_drop_video(q);
+        if (!q->waiting_key) started = 1;
+        q->waiting_key = !(is_video && is_key);
+        if (is_video && !is_key) {
+            q->dropped_video++;
+            pthread_mutex_unlock(&q->lock);
+            av_packet_free(&pkt);
+            return started;
+        }
+        /* Only audio left and still full: shed the oldest audio */
+        while (q->count > 0 && (q->count == q->cap || q->bytes + pkt->size > q->max_bytes)) {
+            AVPacket *old = q->pkts[q->head];
+            q->head = (q->head + 1) % q->cap;
+            q->count--;
+            q->bytes -= old->size;
+            q->dropped_audio++;
+            av_packet_free(&old);
+        }
+    }
+
+    int slot = (q->head + q->count) % q->cap;
+    q->pkts[slot]   = pkt;
+    q->enq_us[slot] = av_gettime_relative();
+    q->count++;
+    q->bytes += pkt->size;
+    if (q->bytes > q->peak_bytes) q->peak_bytes = q->bytes;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return started;
+}
+
+/* Blocks until a packet is available; NULL once closed and drained */
+static AVPacket *pq_pop(PacketQueue *q, int64_t *enq_us) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->cond, &q->lock);
+    AVPacket *pkt = NULL;
+    if (q->count > 0) {
+        pkt = q->pkts[q->head];
+        if (enq_us) *enq_us = q->enq_us[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        q->bytes -= pkt->size;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return pkt;
+}
+
+static void pq_close(PacketQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* ================================================================== */
+/*  Encode helpers                                                     */
+/* ================================================================== */
+/* Ask for an IDR on the next video frame. Served by encode_write_video no
+ * sooner than idr_min_frames after the previous keyframe, so a flapping
+ * source can't turn the stream into all-intra; a keyframe the encoder makes
+ * on its own in the meantime satisfies the request. x264 restarts its GOP
+ * cadence from every IDR. */
+static void request_idr(OutputCtx *o) {
+    if (o->idr_request_pts < 0)
+        o->idr_request_pts = o->video_pts;
+}
+
+static int encode_write_video(OutputCtx *o, AVFrame *frame) {
+    TRACE_BEGIN(tr_enc);
+    frame->pts = o->video_pts++;
+    o->frames++;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (o->idr_request_pts >= 0) {
+        if (o->last_key_pts >= o->idr_request_pts) {
+            o->idr_request_pts = -1;
+        } else if (frame->pts - o->last_key_pts >= o->idr_min_frames) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            o->idr_request_pts = -1;
+            o->forced_idrs++;
+        }
+    }
+    if (avcodec_send_frame(o->video_enc_ctx, frame) >= 0)
+        video_receive(o);
+    TRACE_END(tr_enc, "encode_write_video");
+    return 0;
+}
+
+/* Hand every packet the video encoder has ready to the output */
+static void video_receive(OutputCtx *o) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt) return;
+    while (avcodec_receive_packet(o->video_enc_ctx, pkt) >= 0) {
+        if (pkt->flags & AV_PKT_FLAG_KEY)
+            o->last_key_pts = pkt->pts;
+        if (o->new_extradata) {
+            /* The FLV muxer turns this into a new AVC sequence header */
+            uint8_t *sd = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                  o->video_enc_ctx->extradata_size);
+            if (sd) {
+                memcpy(sd, o->video_enc_ctx->extradata, o->video_enc_ctx->extradata_size);
+                o->new_extradata = 0;
+            }
+        }
+        if (g_cfg.latency_probe)
+            probe_attach(o, pkt);
+        pkt->stream_index = o->video_stream->index;
+        av_packet_rescale_ts(pkt, o->video_enc_ctx->time_base, o->video_stream->time_base);
+        output_packet(o, pkt);
+    }
+    av_packet_free(&pkt);
+}
+
+/* Swap in a freshly opened encoder, flushing the old one's delayed frames
+ * first. The new encoder starts with an IDR and the timestamps carry on.
+ * Returns -1 (keeping the old encoder) if the new one can't be opened. */
+static int encoder_reopen(OutputCtx *o, const char *x264_params) {
+    AVCodecContext *c = open_video_encoder(o, x264_params);
+    if (!c) return -1;
+
+    avcodec_send_frame(o->video_enc_ctx, NULL);
+    video_receive(o);
+    avcodec_free_context(&o->video_enc_ctx);
+    o->video_enc_ctx = c;
+
+    const AVCodecParameters *par = o->video_stream->codecpar;
+    if (c->extradata_size != par->extradata_size ||
+        (c->extradata_size && memcmp(c->extradata, par->extradata, c->extradata_size)))
+        o->new_extradata = 1;
+    if (o->rate_full && o->rate_cur != o->rate_full)
+        rate_apply(o, o->rate_cur);
+    return 0;
+}
+
+static int read_bg_frame(SourceCtx *s, AVFrame *scaled, AVAudioFifo *afifo) {
+    TRACE_BEGIN(tr_read);
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame  *raw = av_frame_alloc();
+    int result = 0;
+    int ret = av_read_frame(s->fmt_ctx, pkt);
+    if (ret < 0) {
+        av_packet_free(&pkt);
+        av_frame_free(&raw);
+        TRACE_END(tr_read, "read_bg_frame");
+        return ret;
+    }
+
+    if (pkt->stream_index == s->video_stream_idx && s->video_dec_ctx) {
+        if (avcodec_send_packet(s->video_dec_ctx, pkt) >= 0 &&
+            avcodec_receive_frame(s->video_dec_ctx, raw) >= 0) {
+            scaled->format = AV_PIX_FMT_YUV420P;
+            scaled->width = g_cfg.out_width;
+            scaled->height = g_cfg.out_height;
+            av_frame_get_buffer(scaled, 0);
+            av_frame_make_writable(scaled);
+            TRACE_BEGIN(tr_sws);
+            sws_scale(s->sws_ctx, (const uint8_t *const *)raw->data,
+                      raw->linesize, 0, raw->height, scaled->data, scaled->linesize);
+            TRACE_END(tr_sws, "sws_scale_bg");
+            result = 1;
+        }
+    } else if (pkt->stream_index == s->audio_stream_idx &&
+               s->audio_dec_ctx && s->swr_ctx) {
+        if (avcodec_send_packet(s->audio_dec_ctx, pkt) >= 0 &&
+            avcodec_receive_frame(s->audio_dec_ctx, raw) >= 0) {
+            int out_n = swr_get_out_samples(s->swr_ctx, raw->nb_samples);
+            if (out_n > 0) {
+                uint8_t *ob[2] = {0};
+                av_samples_alloc(ob, NULL, g_cfg.out_channels, out_n, AV_SAMPLE_FMT_FLTP, 0);
+                int c = swr_convert(s->swr_ctx, ob, out_n,
+                                    (const uint8_t **)raw->data, raw->nb_samples);
+                if (c > 0) av_audio_fifo_write(afifo, (void **)ob, c);
+                av_freep(&ob[0]);
+            }
+            result = 2;
+        }
+    }
+    av_frame_free(&raw);
+    av_packet_free(&pkt);
+    TRACE_END(tr_read, "read_bg_frame");
+    return result;
+}
+
+static void loop_bg(SourceCtx *s) {
+    avio_seek(s->fmt_ctx->pb, 0, SEEK_SET);
+    avformat_seek_file(s->fmt_ctx, -1, INT64_MIN, 0, INT64_MAX, 0);
     avcodec_flush_buffers(s->video_dec_ctx);
     if (s->audio_dec_ctx) avcodec_flush_buffers(s->audio_dec_ctx);
 }
 
-static void encode_one_audio_frame(AppState *app, AVAudioFifo *fifo, int aframe_sz) {
-    AVFrame *f = av_frame_alloc();
-    f->format = AV_SAMPLE_FMT_FLTP;
-    f->nb_samples = aframe_sz;
-    f->channel_layout = AV_CH_LAYOUT_STEREO;
-    f->channels = g_cfg.out_channels;
-    f->sample_rate = g_cfg.sample_rate;
-    av_frame_get_buffer(f, 0);
+static void encode_one_audio_frame(AppState *app, AVAudioFifo *fifo, int aframe_sz) {
+    TRACE_BEGIN(tr_enc);
+    AVFrame *f = av_frame_alloc();
+    f->format = AV_SAMPLE_FMT_FLTP;
+    f->nb_samples = aframe_sz;
+    f->channel_layout = AV_CH_LAYOUT_STEREO;
+    f->channels = g_cfg.out_channels;
+    f->sample_rate = g_cfg.sample_rate;
+    av_frame_get_buffer(f, 0);
+
+    int avail = av_audio_fifo_size(fifo);
+    if (avail >= aframe_sz) {
+        av_audio_fifo_read(fifo, (void **)f->data, aframe_sz);
+    } else {
+        app->stats.pad_samples += aframe_sz - avail;
+        int plane_size = aframe_sz * av_get_bytes_per_sample(AV_SAMPLE_FMT_FLTP);
+        for (int ch = 0; ch < g_cfg.out_channels; ch++)
+            memset(f->data[ch], 0, plane_size);
+        if (avail > 0)
+            av_audio_fifo_read(fifo, (void **)f->data, avail);
+    }
+
+    f->pts = app->out.audio_pts;
+    app->out.audio_pts += aframe_sz;
+
+    AVPacket *pkt = av_packet_alloc();
+    int ret = avcodec_send_frame(app->out.audio_enc_ctx, f);
+    av_frame_free(&f);
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(app->out.audio_enc_ctx, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+        if (ret < 0) break;
+        pkt->stream_index = app->out.audio_stream->index;
+        av_packet_rescale_ts(pkt, app->out.audio_enc_ctx->time_base,
+                             app->out.audio_stream->time_base);
+        output_packet(&app->out, pkt);
+    }
+    av_packet_free(&pkt);
+    TRACE_END(tr_enc, "encode_one_audio_frame");
+}
+
+/* ================================================================== */
+/*  Frame clock — absolute deadlines on CLOCK_MONOTONIC                */
+/* ================================================================== */
+
+static const int64_t jitter_bounds_us[JITTER_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000
+};
+
+/* 29.97 / 59.94 / 23.976 map to the exact NTSC x/1001 rates */
+static AVRational fps_to_rational(double fps) {
+    double ntsc = fps * 1.001;
+    if (fabs(fps - round(fps)) > 0.001 && fabs(ntsc - round(ntsc)) < 0.01)
+        return (AVRational){ (int)lrint(ntsc) * 1000, 1001 };
+    return av_d2q(fps, 100000);
+}
+
+/* Time base of the SRT state machine: wall clock, or the virtual clock
+ * under --simulate */
+static int64_t clock_us(void) {
+    return g_sim_now_us >= 0 ? g_sim_now_us : av_gettime_relative();
+}
+
+static int64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fclock_init(FrameClock *c, AVRational rate) {
+    memset(c, 0, sizeof(*c));
+    c->rate     = rate;
+    c->epoch_ns = mono_ns();
+}
+
+static int64_t fclock_deadline_ns(const FrameClock *c, int64_t tick) {
+    return c->epoch_ns + av_rescale(tick, 1000000000LL * c->rate.den, c->rate.num);
+}
+
+/* Advance to the next deadline and sleep until it. Returns how many further
+ * frame slots have already passed (0 when on time); the caller applies
+ * g_cfg.late_policy to those. */
+static int fclock_wait(FrameClock *c) {
+    c->tick++;
+    int64_t deadline = fclock_deadline_ns(c, c->tick);
+    int64_t now = mono_ns();
+
+    if (now < deadline) {
+        struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && g_running)
+            ;
+        now = mono_ns();
+    }
+
+    int64_t late_us = (now - deadline) / 1000;
+    int b = 0;
+    while (b < JITTER_BUCKETS - 1 && late_us > jitter_bounds_us[b]) b++;
+    c->jitter_hist[b]++;
+
+    int64_t frame_ns = fclock_deadline_ns(c, 1) - c->epoch_ns;
+    int64_t missed = (now - deadline) / frame_ns;
+    if (missed <= 0) return 0;
+
+    c->late_ticks++;
+    /* Stalled for over a second (suspend, debugger, disk hang): re-anchor
+     * rather than bursting or skipping a whole second of frames. */
+    if (missed > c->rate.num / c->rate.den) {
+        c->epoch_ns = now;
+        c->tick     = 0;
+        c->resyncs++;
+        jlog("clock_resync", NULL);
+        return 0;
+    }
+    c->missed_ticks += missed;
+    return (int)missed;
+}
+
+static int fclock_hist_json(const FrameClock *c, char *buf, size_t size) {
+    int n = snprintf(buf, size, "\"late_ticks\":%lld,\"missed_ticks\":%lld,\"tick_jitter_us\":{",
+                     (long long)c->late_ticks, (long long)c->missed_ticks);
+    for (int b = 0; b < JITTER_BUCKETS && n < (int)size; b++) {
+        if (b < JITTER_BUCKETS - 1)
+            n += snprintf(buf + n, size - n, "\"%lld\":%lld,",
+                          (long long)jitter_bounds_us[b], (long long)c->jitter_hist[b]);
+        else
+            n += snprintf(buf + n, size - n, "\"inf\":%lld}", (long long)c->jitter_hist[b]);
+    }
+    return n;
+}
+
+/* ================================================================== */
+/*  Stats — measured once per window from monotonic timestamps         */
+/* ================================================================== */
+
+static const char *const stage_names[ST_COUNT] = {
+    "bg_decode", "srt_copy", "video_encode", "audio_encode", "output"
+};
+
+static void tick_stats_add(TickStats *ts, const int64_t stage_us[ST_COUNT], int64_t busy_us) {
+    for (int i = 0; i < ST_COUNT; i++)
+        ts->stage_us[i] += stage_us[i];
+    if (ts->ticks < TICK_SAMPLES)
+        ts->tick_us[ts->ticks++] = busy_us;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Emit the stats event and start a new window */
+static void emit_stats(AppState *app, FrameClock *clk, TickStats *ts, enum AudioMode audio_mode) {
+    SrtShared *sh = &app->shared;
+    OutputCtx *o = &app->out;
+    int64_t now = av_gettime_relative();
+    double elapsed = (now - ts->start_us) / 1e6;
+    double fps = elapsed > 0 ? (o->frames - ts->frames) / elapsed : 0.0;
+
+    pthread_mutex_lock(&sh->lock);
+    int srt_conn = sh->connected;
+    int64_t srt_connects = sh->connects, srt_received = sh->video_received;
+    int64_t srt_decoded = sh->video_decoded, srt_dropped = sh->video_dropped;
+    int srt_fifo = av_audio_fifo_size(sh->audio_fifo);
+    pthread_mutex_unlock(&sh->lock);
+
+    char extra[4096];
+    int n = snprintf(extra, sizeof(extra),
+                     "\"fps\":%.2f,\"target_fps\":%.3f,\"srt_connected\":%s,\"audio_mode\":\"%s\",",
+                     fps, av_q2d(g_cfg.out_rate),
+                     srt_conn ? "true" : "false",
+                     audio_mode == AUDIO_SRT ? "srt" :
+                     audio_mode == AUDIO_GRACE ? "grace" : "bg");
+
+    /* Busy time per tick: percentiles over the window */
+    if (ts->ticks > 0) {
+        qsort(ts->tick_us, ts->ticks, sizeof(ts->tick_us[0]), cmp_int64);
+        n += snprintf(extra + n, sizeof(extra) - n,
+                      "\"tick_us\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld},",
+                      (long long)ts->tick_us[ts->ticks / 2],
+                      (long long)ts->tick_us[ts->ticks * 9 / 10],
+                      (long long)ts->tick_us[ts->ticks * 99 / 100],
+                      (long long)ts->tick_us[ts->ticks - 1]);
+    }
+
+    /* Average per tick; mux is the writer thread's time inside the muxer */
+    PacketQueue *q = &o->queue;
+    pthread_mutex_lock(&q->lock);
+    int64_t mux_us = o->mux_lat.busy_us;
+    o->mux_lat.busy_us = 0;
+    pthread_mutex_unlock(&q->lock);
+    int ticks = ts->ticks > 0 ? ts->ticks : 1;
+    n += snprintf(extra + n, sizeof(extra) - n, "\"stage_us\":{");
+    for (int i = 0; i < ST_COUNT; i++)
+        n += snprintf(extra + n, sizeof(extra) - n, "\"%s\":%lld,",
+                      stage_names[i], (long long)(ts->stage_us[i] / ticks));
+    n += snprintf(extra + n, sizeof(extra) - n, "\"mux\":%lld},", (long long)(mux_us / ticks));
+
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "\"srt\":{\"connects\":%lld,\"received\":%lld,\"decoded\":%lld,\"dropped\":%lld},",
+                  (long long)srt_connects, (long long)srt_received,
+                  (long long)srt_decoded, (long long)srt_dropped);
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "\"audio_fifo_ms\":{\"srt_shared\":%d,\"srt_local\":%d,\"bg\":%d},",
+                  (int)((int64_t)srt_fifo * 1000 / g_cfg.sample_rate),
+                  (int)((int64_t)av_audio_fifo_size(app->srt_local_fifo) * 1000 / g_cfg.sample_rate),
+                  (int)((int64_t)av_audio_fifo_size(app->bg_audio_fifo) * 1000 / g_cfg.sample_rate));
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "\"dup_ticks\":{\"srt\":%lld,\"bg\":%lld,\"late\":%lld,\"governor\":%lld},",
+                  (long long)app->stats.dup_srt, (long long)app->stats.dup_bg,
+                  (long long)app->stats.dup_late, (long long)app->stats.dup_gov);
+    if (app->gov.max_level)
+        n += snprintf(extra + n, sizeof(extra) - n,
+                      "\"governor\":{\"level\":%d,\"name\":\"%s\",\"load\":%.2f},",
+                      app->gov.level, governor_level_name(app->gov.level), app->gov.load);
+    n += snprintf(extra + n, sizeof(extra) - n, "\"forced_idrs\":%lld,",
+                  (long long)o->forced_idrs);
+    if (o->rate_full)
+        n += snprintf(extra + n, sizeof(extra) - n, "\"video_target_bps\":%d,",
+                      o->rate_cur);
+    pthread_mutex_lock(&q->lock);
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "\"out_queue\":{\"pkts\":%d,\"bytes\":%lld,\"peak_bytes\":%lld,"
+                  "\"dropped_video\":%lld,\"dropped_audio\":%lld},",
+                  q->count, (long long)q->bytes, (long long)q->peak_bytes,
+                  (long long)q->dropped_video, (long long)q->dropped_audio);
+    q->peak_bytes = q->bytes;
+    Metrics *m = &app->metrics;
+    atomic_store_explicit(&m->out_queue_pkts, q->count, memory_order_relaxed);
+    atomic_store_explicit(&m->out_queue_bytes, q->bytes, memory_order_relaxed);
+    atomic_store_explicit(&m->out_dropped[0], q->dropped_video, memory_order_relaxed);
+    atomic_store_explicit(&m->out_dropped[1], q->dropped_audio, memory_order_relaxed);
+    MuxLatency *ml = &o->mux_lat;
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "\"mux_latency_us\":{\"mode\":\"%s\",\"avg\":%lld,\"max\":%lld},",
+                  g_cfg.mux_mode == MUX_LOWLATENCY ? "lowlatency" : "interleaved",
+                  (long long)(ml->n ? ml->sum_us / ml->n : 0), (long long)ml->max_us);
+    ml->sum_us = ml->max_us = ml->n = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    DelayLine *dl = &o->delay;
+    if (dl->active)
+        n += snprintf(extra + n, sizeof(extra) - n,
+                      "\"delay\":{\"seconds\":%.3f,\"target\":%.3f,"
+                      "\"buffered_pkts\":%d,\"buffered_bytes\":%lld},",
+                      dl->delay_us / 1e6, dl->target_us / 1e6,
+                      dl->fifo.count, (long long)dl->fifo.bytes);
+
+    ReplayRing *rr = &o->replay;
+    if (rr->span_us && rr->fifo.count)
+        n += snprintf(extra + n, sizeof(extra) - n,
+                      "\"replay\":{\"seconds\":%.3f,\"bytes\":%lld,\"clips\":%lld},",
+                      (rr->newest_us - pkt_dts_us(o, fifo_peek(&rr->fifo, 0))) / 1e6,
+                      (long long)rr->fifo.bytes, (long long)rr->clips);
+
+    Recorder *rec = &o->rec;
+    if (rec->running) {
+        recorder_poll(rec);
+        pthread_mutex_lock(&rec->queue.lock);
+        n += snprintf(extra + n, sizeof(extra) - n,
+                      "\"recording\":{\"state\":\"%s\",\"bytes\":%lld,"
+                      "\"queued_bytes\":%lld,\"dropped\":%lld},",
+                      rec->failed ? "failed" : rec->degraded ? "degraded" : "ok",
+                      (long long)rec->bytes_written, (long long)rec->queue.bytes,
+                      (long long)(rec->queue.dropped_video + rec->queue.dropped_audio));
+        pthread_mutex_unlock(&rec->queue.lock);
+    }
+    if (app->perf.main.tid)
+        n += perf_stats_json(app, extra + n, sizeof(extra) - n);
+    fclock_hist_json(clk, extra + n, sizeof(extra) - n);
+    jlog("stats", extra);
+
+    /* Gauges for the metrics endpoint that are owned by main_loop or a lock */
+    atomic_store_explicit(&m->srt_connected, srt_conn, memory_order_relaxed);
+    atomic_store_explicit(&m->audio_fifo[0], srt_fifo, memory_order_relaxed);
+    atomic_store_explicit(&m->audio_fifo[1], av_audio_fifo_size(app->srt_local_fifo),
+                          memory_order_relaxed);
+    atomic_store_explicit(&m->audio_fifo[2], av_audio_fifo_size(app->bg_audio_fifo),
+                          memory_order_relaxed);
+    atomic_store_explicit(&m->delay_bytes, dl->fifo.bytes, memory_order_relaxed);
+    atomic_store_explicit(&m->replay_bytes, rr->fifo.bytes, memory_order_relaxed);
+    atomic_store_explicit(&m->governor_level, app->gov.level, memory_order_relaxed);
+
+    memset(ts, 0, sizeof(*ts));
+    ts->start_us = now;
+    ts->frames   = o->frames;
+}
+
+/* ================================================================== */
+/*  Metrics endpoint — Prometheus text format over a Unix socket       */
+/*  e.g. curl -s --unix-socket /run/ree/metrics.sock http://x/metrics  */
+/* ================================================================== */
+
+/* Bucket upper bounds in µs; exposed in seconds */
+static const int64_t metric_bounds_us[METRIC_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 16000, 33000, 66000, 250000
+};
+
+static int metrics_open(AppState *app) {
+    Metrics *m = &app->metrics;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_cfg.metrics_socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    m->fd = fd;
+    if (pthread_create(&m->thread, NULL, metrics_thread_func, app) != 0) {
+        close(fd);
+        unlink(g_cfg.metrics_socket);
+        m->fd = -1;
+        return -1;
+    }
+    jlog("metrics_ready", NULL);
+    return 0;
+}
+
+static void metric_observe(MetricHist *h, int64_t us) {
+    int b = 0;
+    while (b < METRIC_BUCKETS - 1 && us > metric_bounds_us[b]) b++;
+    atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+/* Called by main_loop once per tick, after pacing */
+static void metrics_tick(Metrics *m, const FrameClock *clk,
+                         const int64_t stage_us[ST_COUNT], int64_t busy_us) {
+    if (m->fd < 0) return;
+    atomic_fetch_add_explicit(&m->ticks, 1, memory_order_relaxed);
+    atomic_store_explicit(&m->late_ticks, clk->late_ticks, memory_order_relaxed);
+    atomic_store_explicit(&m->missed_ticks, clk->missed_ticks, memory_order_relaxed);
+    atomic_store_explicit(&m->resyncs, clk->resyncs, memory_order_relaxed);
+    metric_observe(&m->tick_us, busy_us);
+    for (int i = 0; i < ST_COUNT; i++)
+        metric_observe(&m->stage_us[i], stage_us[i]);
+}
+
+/* One scrape per connection. Waits for the stop flag with a short poll
+ * so shutdown doesn't depend on a client showing up. */
+static void *metrics_thread_func(void *arg) {
+    AppState *app = (AppState *)arg;
+    Metrics  *m   = &app->metrics;
+    while (!atomic_load(&m->stop)) {
+        struct pollfd p = { .fd = m->fd, .events = POLLIN };
+        if (poll(&p, 1, 250) <= 0) continue;
+        int c = accept4(m->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0) continue;
+        metrics_serve(app, c);
+        close(c);
+    }
+    return NULL;
+}
+
+/* Answer any request (or none, for plain socket readers) with an HTTP/1.0
+ * response. Timeouts keep a stuck client from holding the thread. */
+static void metrics_serve(AppState *app, int fd) {
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char req[1024];
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    if (poll(&p, 1, 100) > 0)
+        recv(fd, req, sizeof(req), MSG_DONTWAIT);
+
+    static char body[32768];
+    int len = metrics_format(app, body, sizeof(body));
+    char head[160];
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %d\r\n\r\n", len);
+    if (send(fd, head, hlen, MSG_NOSIGNAL) != hlen) return;
+    for (int off = 0; off < len; ) {
+        ssize_t w = send(fd, body + off, len - off, MSG_NOSIGNAL);
+        if (w <= 0) return;
+        off += (int)w;
+    }
+}
+
+static void metrics_printf(char *buf, size_t size, int *n, const char *fmt, ...) {
+    if (*n >= (int)size) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int w = vsnprintf(buf + *n, size - *n, fmt, ap);
+    va_end(ap);
+    if (w > 0) *n = *n + w < (int)size ? *n + w : (int)size - 1;
+}
 
-    int avail = av_audio_fifo_size(fifo);
-    if (avail >= aframe_sz) {
-        av_audio_fifo_read(fifo, (void **)f->data, aframe_sz);
-    } else {
-        int plane_size = aframe_sz * av_get_bytes_per_sample(AV_SAMPLE_FMT_FLTP);
-        for (int ch = 0; ch < g_cfg.out_channels; ch++)
-            memset(f->data[ch], 0, plane_size);
-        if (avail > 0)
-            av_audio_fifo_read(fifo, (void **)f->data, avail);
+/* Buckets, sum and count of one histogram series; label is "" or
+ * "key=\"value\"," */
+static void metrics_hist(char *buf, size_t size, int *n, const char *name,
+                         const char *label, const MetricHist *h) {
+    uint64_t cum = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        cum += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+        if (b < METRIC_BUCKETS - 1)
+            metrics_printf(buf, size, n, "%s_bucket{%sle=\"%g\"} %llu\n",
+                           name, label, metric_bounds_us[b] / 1e6, (unsigned long long)cum);
+        else
+            metrics_printf(buf, size, n, "%s_bucket{%sle=\"+Inf\"} %llu\n",
+                           name, label, (unsigned long long)cum);
     }
+    /* Drop the trailing comma for the sum/count label set */
+    char plain[128];
+    snprintf(plain, sizeof(plain), "%s", label);
+    size_t pl = strlen(plain);
+    if (pl && plain[pl - 1] == ',') plain[pl - 1] = '\0';
+    const char *lb = plain[0] ? "{" : "", *rb = plain[0] ? "}" : "";
+    metrics_printf(buf, size, n, "%s_sum%s%s%s %.6f\n", name, lb, plain, rb,
+                   atomic_load_explicit(&h->sum_us, memory_order_relaxed) / 1e6);
+    metrics_printf(buf, size, n, "%s_count%s%s%s %llu\n", name, lb, plain, rb,
+                   (unsigned long long)cum);
+}
 
-    f->pts = app->out.audio_pts;
-    app->out.audio_pts += aframe_sz;
+#define M_LOAD(x) ((long long)atomic_load_explicit(&(x), memory_order_relaxed))
 
-    AVPacket *pkt = av_packet_alloc();
-    int ret = avcodec_send_frame(app->out.audio_enc_ctx, f);
-    av_frame_free(&f);
+static int metrics_format(AppState *app, char *buf, size_t size) {
+    Metrics   *m  = &app->metrics;
+    SrtShared *sh = &app->shared;
+    OutputCtx *o  = &app->out;
+    int n = 0;
+    char label[128];
+
+    char id[256];
+    int j = 0;
+    for (const char *c = g_cfg.stream_id; *c && j < (int)sizeof(id) - 2; c++) {
+        if (*c == '"' || *c == '\\') id[j++] = '\\';
+        id[j++] = *c;
+    }
+    id[j] = '\0';
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_info Compositor instance.\n"
+        "# TYPE srt_compositor_info gauge\n"
+        "srt_compositor_info{stream_id=\"%s\"} 1\n", id);
+
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_ticks_total Frame clock ticks run by the main loop.\n"
+        "# TYPE srt_compositor_ticks_total counter\n"
+        "srt_compositor_ticks_total %lld\n"
+        "# HELP srt_compositor_late_ticks_total Ticks that woke up after a whole frame slot.\n"
+        "# TYPE srt_compositor_late_ticks_total counter\n"
+        "srt_compositor_late_ticks_total %lld\n"
+        "# HELP srt_compositor_missed_ticks_total Frame slots lost to lateness.\n"
+        "# TYPE srt_compositor_missed_ticks_total counter\n"
+        "srt_compositor_missed_ticks_total %lld\n"
+        "# HELP srt_compositor_clock_resyncs_total Frame clock re-anchors after a stall.\n"
+        "# TYPE srt_compositor_clock_resyncs_total counter\n"
+        "srt_compositor_clock_resyncs_total %lld\n",
+        M_LOAD(m->ticks), M_LOAD(m->late_ticks), M_LOAD(m->missed_ticks), M_LOAD(m->resyncs));
+
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_dup_ticks_total Ticks that re-sent the previous picture.\n"
+        "# TYPE srt_compositor_dup_ticks_total counter\n"
+        "srt_compositor_dup_ticks_total{cause=\"srt\"} %lld\n"
+        "srt_compositor_dup_ticks_total{cause=\"bg\"} %lld\n"
+        "srt_compositor_dup_ticks_total{cause=\"late\"} %lld\n"
+        "srt_compositor_dup_ticks_total{cause=\"governor\"} %lld\n",
+        M_LOAD(app->stats.dup_srt), M_LOAD(app->stats.dup_bg),
+        M_LOAD(app->stats.dup_late), M_LOAD(app->stats.dup_gov));
+
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_tick_seconds Main loop busy time per tick.\n"
+        "# TYPE srt_compositor_tick_seconds histogram\n");
+    metrics_hist(buf, size, &n, "srt_compositor_tick_seconds", "", &m->tick_us);
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_stage_seconds Main loop time per tick by stage.\n"
+        "# TYPE srt_compositor_stage_seconds histogram\n");
+    for (int i = 0; i < ST_COUNT; i++) {
+        snprintf(label, sizeof(label), "stage=\"%s\",", stage_names[i]);
+        metrics_hist(buf, size, &n, "srt_compositor_stage_seconds", label, &m->stage_us[i]);
+    }
+
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_srt_connected Whether an SRT sender is connected.\n"
+        "# TYPE srt_compositor_srt_connected gauge\n"
+        "srt_compositor_srt_connected %d\n"
+        "# HELP srt_compositor_srt_connects_total SRT connections accepted.\n"
+        "# TYPE srt_compositor_srt_connects_total counter\n"
+        "srt_compositor_srt_connects_total %lld\n"
+        "# HELP srt_compositor_srt_received_bytes_total SRT input bytes read.\n"
+        "# TYPE srt_compositor_srt_received_bytes_total counter\n"
+        "srt_compositor_srt_received_bytes_total %lld\n"
+        "# HELP srt_compositor_srt_video_packets_total SRT video packets read.\n"
+        "# TYPE srt_compositor_srt_video_packets_total counter\n"
+        "srt_compositor_srt_video_packets_total %lld\n"
+        "# HELP srt_compositor_srt_pictures_dropped_total Decoded SRT pictures replaced before use.\n"
+        "# TYPE srt_compositor_srt_pictures_dropped_total counter\n"
+        "srt_compositor_srt_pictures_dropped_total %lld\n",
+        atomic_load_explicit(&m->srt_connected, memory_order_relaxed),
+        M_LOAD(sh->connects), M_LOAD(m->srt_bytes),
+        M_LOAD(sh->video_received), M_LOAD(sh->video_dropped));
+
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_output_bytes_total Encoded bytes by stream.\n"
+        "# TYPE srt_compositor_output_bytes_total counter\n"
+        "srt_compositor_output_bytes_total{stream=\"video\"} %lld\n"
+        "srt_compositor_output_bytes_total{stream=\"audio\"} %lld\n"
+        "# HELP srt_compositor_out_queue_packets Packets waiting for the FLV writer.\n"
+        "# TYPE srt_compositor_out_queue_packets gauge\n"
+        "srt_compositor_out_queue_packets %lld\n"
+        "# HELP srt_compositor_out_queue_bytes Bytes waiting for the FLV writer.\n"
+        "# TYPE srt_compositor_out_queue_bytes gauge\n"
+        "srt_compositor_out_queue_bytes %lld\n"
+        "# HELP srt_compositor_out_queue_dropped_total Packets the FLV writer queue dropped.\n"
+        "# TYPE srt_compositor_out_queue_dropped_total counter\n"
+        "srt_compositor_out_queue_dropped_total{stream=\"video\"} %lld\n"
+        "srt_compositor_out_queue_dropped_total{stream=\"audio\"} %lld\n",
+        M_LOAD(o->bytes_out[0]), M_LOAD(o->bytes_out[1]),
+        M_LOAD(m->out_queue_pkts), M_LOAD(m->out_queue_bytes),
+        M_LOAD(m->out_dropped[0]), M_LOAD(m->out_dropped[1]));
+
+    double sr = g_cfg.sample_rate;
+    metrics_printf(buf, size, &n,
+        "# HELP srt_compositor_audio_fifo_seconds Audio buffered per FIFO.\n"
+        "# TYPE srt_compositor_audio_fifo_seconds gauge\n"
+        "srt_compositor_audio_fifo_seconds{fifo=\"srt_shared\"} %.4f\n"
+        "srt_compositor_audio_fifo_seconds{fifo=\"srt_local\"} %.4f\n"
+        "srt_compositor_audio_fifo_seconds{fifo=\"bg\"} %.4f\n"
+        "# HELP srt_compositor_delay_buffer_bytes Bytes held by the broadcast delay.\n"
+        "# TYPE srt_compositor_delay_buffer_bytes gauge\n"
+        "srt_compositor_delay_buffer_bytes %lld\n"
+        "# HELP srt_compositor_replay_buffer_bytes Bytes held by the instant-replay ring.\n"
+        "# TYPE srt_compositor_replay_buffer_bytes gauge\n"
+        "srt_compositor_replay_buffer_bytes %lld\n"
+        "# HELP srt_compositor_governor_level Overload governor level, 0 = normal.\n"
+        "# TYPE srt_compositor_governor_level gauge\n"
+        "srt_compositor_governor_level %d\n"
+        "# HELP srt_compositor_log_dropped_total Log lines dropped by a full log ring.\n"
+        "# TYPE srt_compositor_log_dropped_total counter\n"
+        "srt_compositor_log_dropped_total %lld\n"
+        "# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+        "# TYPE process_resident_memory_bytes gauge\n"
+        "process_resident_memory_bytes %lld\n",
+        M_LOAD(m->audio_fifo[0]) / sr, M_LOAD(m->audio_fifo[1]) / sr,
+        M_LOAD(m->audio_fifo[2]) / sr,
+        M_LOAD(m->delay_bytes), M_LOAD(m->replay_bytes),
+        atomic_load_explicit(&m->governor_level, memory_order_relaxed),
+        M_LOAD(g_log.dropped), (long long)rss_bytes());
+    return n;
+}
+
+#undef M_LOAD
+
+static int64_t rss_bytes(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    long long size = 0, resident = 0;
+    int ok = fscanf(f, "%lld %lld", &size, &resident) == 2;
+    fclose(f);
+    return ok ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void metrics_close(Metrics *m) {
+    if (m->fd < 0) return;
+    atomic_store(&m->stop, 1);
+    pthread_join(m->thread, NULL);
+    close(m->fd);
+    unlink(g_cfg.metrics_socket);
+    m->fd = -1;
+}
+
+/* ================================================================== */
+/*  Overload governor                                                  */
+/* ================================================================== */
+
+#define GOV_HIGH_LOAD      0.85   /* busy fraction that counts as overloaded */
+#define GOV_LOW_LOAD       0.45   /* ... and as comfortably idle */
+#define GOV_DEGRADE_AFTER  3      /* consecutive overloaded windows */
+#define GOV_RECOVER_AFTER  10     /* consecutive idle windows */
+
+/* Speed-only x264 tuning per preset: none of these change SPS/PPS, so the
+ * reopened encoder's stream stays decodable with the original sequence
+ * header. Each entry only lowers what that preset sets higher (x264's
+ * preset table); ultrafast and superfast already run at or below
+ * subme=1/me=dia/trellis=0, where reopening would only cost an IDR. */
+static const char *const gov_fast_x264[][2] = {
+    { "ultrafast", NULL },
+    { "superfast", NULL },
+    { "veryfast",  "subme=1:me=dia" },
+    { "faster",    "subme=1:me=dia:trellis=0" },
+};
+#define GOV_FAST_X264 "subme=1:me=dia:trellis=0:mixed-refs=0:fast-pskip=1:psy=0"
+
+static const char *const gov_level_names[GOV_LEVELS] = {
+    "normal", "fast_scale", "skip_bg", "fast_encoder", "half_rate"
+};
+
+static const char *governor_level_name(int level) {
+    return gov_level_names[level];
+}
+
+/* x264-params of the fast_encoder level for a preset, NULL if the preset
+ * is already that fast and the level is skipped */
+static const char *governor_x264_params(const char *preset) {
+    for (size_t i = 0; i < sizeof(gov_fast_x264) / sizeof(gov_fast_x264[0]); i++)
+        if (strcmp(preset, gov_fast_x264[i][0]) == 0)
+            return gov_fast_x264[i][1];
+    return GOV_FAST_X264;
+}
+
+/* Add one tick: per-stage times and the whole tick's busy time */
+static void governor_account(Governor *g, const int64_t stage_us[ST_COUNT], int64_t busy_us) {
+    for (int i = 0; i < ST_COUNT; i++)
+        g->stage_us[i] += stage_us[i];
+    g->busy_us += busy_us;
+    g->ticks++;
+}
+
+/* Called once per stats window */
+static void governor_update(AppState *app, const FrameClock *clk) {
+    Governor *g = &app->gov;
+    if (!g->ticks) return;
+
+    double frame_us = 1e6 * g_cfg.out_rate.den / g_cfg.out_rate.num;
+    g->load = g->busy_us / (g->ticks * frame_us);
+    int missed = clk->missed_ticks > g->missed_seen;
+    g->missed_seen = clk->missed_ticks;
+
+    if (g->load > GOV_HIGH_LOAD || missed) { g->over++;  g->under = 0; }
+    else if (g->load < GOV_LOW_LOAD)       { g->under++; g->over  = 0; }
+    else                                   { g->over = g->under = 0; }
+
+    /* fast_encoder has nothing to shed on the fastest presets: step over it */
+    int skip_enc = !governor_x264_params(g_cfg.enc.preset);
+    int level = g->level;
+    if (g->over >= GOV_DEGRADE_AFTER && level < g->max_level) {
+        level++;
+        if (level == GOV_FAST_ENC && skip_enc)
+            level = level < g->max_level ? level + 1 : level - 1;
+    } else if (g->under >= GOV_RECOVER_AFTER && level > GOV_NORMAL) {
+        level--;
+        if (level == GOV_FAST_ENC && skip_enc)
+            level--;
+    }
+
+    if (level != g->level) {
+        char extra[512];
+        int n = snprintf(extra, sizeof(extra),
+                         "\"level\":%d,\"name\":\"%s\",\"from\":\"%s\",\"load\":%.2f,"
+                         "\"stage_ms\":{",
+                         level, gov_level_names[level], gov_level_names[g->level], g->load);
+        for (int i = 0; i < ST_COUNT; i++)
+            n += snprintf(extra + n, sizeof(extra) - n, "%s\"%s\":%.2f", i ? "," : "",
+                          stage_names[i], g->stage_us[i] / 1e3 / g->ticks);
+        snprintf(extra + n, sizeof(extra) - n, "}");
+        jlog("governor", extra);
+        governor_set_level(app, level);
+        g->over = g->under = 0;
+    }
+    g->busy_us = g->ticks = 0;
+    memset(g->stage_us, 0, sizeof(g->stage_us));
+}
+
+/* Apply the settings that differ between the old and new level. The
+ * background-skip and half-rate levels are read by main_loop directly. */
+static void governor_set_level(AppState *app, int level) {
+    Governor *g = &app->gov;
+    int old = g->level;
+    g->level = level;
+
+    if ((level >= GOV_FAST_SCALE) != (old >= GOV_FAST_SCALE)) {
+        int flags = level >= GOV_FAST_SCALE ? SWS_FAST_BILINEAR : SWS_BILINEAR;
+        atomic_store(&app->sws_flags, flags);   /* SRT thread picks it up */
+        if (app->bg.video_dec_ctx)
+            source_scaler(&app->bg, flags);
+    }
+    const char *fast = governor_x264_params(g_cfg.enc.preset);
+    if (fast && (level >= GOV_FAST_ENC) != (old >= GOV_FAST_ENC)) {
+        if (encoder_reopen(&app->out, level >= GOV_FAST_ENC ? fast : NULL) < 0)
+            jlog("error", "\"message\":\"Governor could not reopen the encoder\"");
+        else if (app->out.new_extradata)
+            jlog("governor", "\"message\":\"Encoder headers changed\"");
+    }
+}
+
+/* ================================================================== */
+/*  Latency probe — loopback glass-to-glass timing (see probe.sh)      */
+/* ================================================================== */
+
+/* Paint the time mark: PROBE_BITS square blocks, MSB first, along the
+ * top edge. Luma 16/235 with neutral chroma survives x264 and scaling. */
+static void probe_paint(uint8_t *y, int linesize, int width, int64_t us) {
+    int bw = width / PROBE_BITS;
+    uint64_t v = (uint64_t)PROBE_SYNC << 56 | ((uint64_t)us & ((1ULL << 56) - 1));
+    for (int i = 0; i < PROBE_BITS; i++) {
+        uint8_t l = (v >> (PROBE_BITS - 1 - i)) & 1 ? 235 : 16;
+        for (int r = 0; r < bw; r++)
+            memset(y + r * linesize + i * bw, l, bw);
+    }
+}
+
+/* Time mark of a picture at output size, 0 if there is none */
+static int64_t probe_read(const uint8_t *y, int linesize, int width) {
+    int bw = width / PROBE_BITS;
+    if (bw < 4) return 0;
+    uint64_t v = 0;
+    for (int i = 0; i < PROBE_BITS; i++) {
+        const uint8_t *p = y + (bw / 2) * linesize + i * bw + bw / 2;
+        int l = (p[0] + p[1] + p[linesize] + p[linesize + 1]) / 4;
+        v = v << 1 | (l > 128);
+    }
+    if ((v >> 56) != PROBE_SYNC) return 0;
+    return (int64_t)(v & ((1ULL << 56) - 1));
+}
+
+/* main_loop is about to encode the picture carrying m */
+static void probe_encode(OutputCtx *o, ProbeMark *m) {
+    m->encode_us = av_gettime();
+    m->pts       = o->video_pts;
+    o->probe_pend[o->probe_next++ % PROBE_PENDING] = *m;
+}
+
+/* Ride along with the encoded packet (pts still in the encoder time
+ * base) to the writer thread; opaque_ref survives queueing and clones */
+static void probe_attach(OutputCtx *o, AVPacket *pkt) {
+    for (int i = 0; i < PROBE_PENDING; i++) {
+        ProbeMark *m = &o->probe_pend[i];
+        if (!m->sent_us || m->pts != pkt->pts) continue;
+        AVBufferRef *b = av_buffer_alloc(sizeof(*m));
+        if (b) {
+            memcpy(b->data, m, sizeof(*m));
+            av_buffer_unref(&pkt->opaque_ref);
+            pkt->opaque_ref = b;
+        }
+        m->sent_us = 0;
+        return;
+    }
+}
+
+/* Writer thread, right after the packet went to the muxer */
+static void probe_report(const ProbeMark *m, int64_t write_us) {
+    char extra[320];
+    snprintf(extra, sizeof(extra),
+             "\"pts\":%lld,\"sender_to_ingest_ms\":%.2f,\"ingest_to_decode_ms\":%.2f,"
+             "\"decode_to_encode_ms\":%.2f,\"encode_to_write_ms\":%.2f,\"total_ms\":%.2f",
+             (long long)m->pts,
+             (m->read_us - m->sent_us) / 1e3, (m->decoded_us - m->read_us) / 1e3,
+             (m->encode_us - m->decoded_us) / 1e3, (write_us - m->encode_us) / 1e3,
+             (write_us - m->sent_us) / 1e3);
+    jlog("probe", extra);
+}
+
+static int probe_write(AVFormatContext *oc, AVCodecContext *c, AVStream *st,
+                       AVFrame *frame, AVPacket *pkt) {
+    int ret = avcodec_send_frame(c, frame);
     while (ret >= 0) {
-        ret = avcodec_receive_packet(app->out.audio_enc_ctx, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+        ret = avcodec_receive_packet(c, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
         if (ret < 0) break;
-        pkt->stream_index = app->out.audio_stream->index;
-        av_packet_rescale_ts(pkt, app->out.audio_enc_ctx->time_base,
-                             app->out.audio_stream->time_base);
-        av_interleaved_write_frame(app->out.fmt_ctx, pkt);
+        pkt->stream_index = st->index;
+        av_packet_rescale_ts(pkt, c->time_base, st->time_base);
+        ret = av_interleaved_write_frame(oc, pkt);
+    }
+    return ret;
+}
+
+/* --probe-send: synthetic SRT caller at the configured output size and
+ * rate. Flat grey picture with the time mark, silent AAC, MPEG-TS. Runs
+ * until SIGINT or the connection fails. */
+static int probe_send(const char *url) {
+    AVFormatContext *oc = NULL;
+    AVCodecContext  *vc = NULL, *ac = NULL;
+    AVFrame  *vf  = av_frame_alloc(), *af = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    int ret = -1;
+
+    const AVCodec *venc = avcodec_find_encoder(AV_CODEC_ID_H264);
+    const AVCodec *aenc = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!vf || !af || !pkt || !venc || !aenc ||
+        avformat_alloc_output_context2(&oc, NULL, "mpegts", url) < 0)
+        goto end;
+
+    vc = avcodec_alloc_context3(venc);
+    vc->width        = g_cfg.out_width;
+    vc->height       = g_cfg.out_height;
+    vc->pix_fmt      = AV_PIX_FMT_YUV420P;
+    vc->time_base    = av_inv_q(g_cfg.out_rate);
+    vc->framerate    = g_cfg.out_rate;
+    vc->gop_size     = g_cfg.out_fps;
+    vc->max_b_frames = 0;
+    vc->bit_rate     = g_cfg.video_bitrate;
+    av_opt_set(vc->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(vc->priv_data, "tune", "zerolatency", 0);
+    if (avcodec_open2(vc, venc, NULL) < 0) goto end;
+
+    ac = avcodec_alloc_context3(aenc);
+    ac->sample_rate    = g_cfg.sample_rate;
+    ac->channel_layout = AV_CH_LAYOUT_STEREO;
+    ac->channels       = g_cfg.out_channels;
+    ac->sample_fmt     = AV_SAMPLE_FMT_FLTP;
+    ac->bit_rate       = g_cfg.audio_bitrate;
+    ac->time_base      = (AVRational){1, g_cfg.sample_rate};
+    if (avcodec_open2(ac, aenc, NULL) < 0) goto end;
+
+    AVStream *vs = avformat_new_stream(oc, NULL);
+    AVStream *as = avformat_new_stream(oc, NULL);
+    if (!vs || !as) goto end;
+    avcodec_parameters_from_context(vs->codecpar, vc);
+    vs->time_base = vc->time_base;
+    avcodec_parameters_from_context(as->codecpar, ac);
+    as->time_base = ac->time_base;
+
+    AVIOInterruptCB cb = { srt_interrupt_cb, NULL };
+    if (avio_open2(&oc->pb, url, AVIO_FLAG_WRITE, &cb, NULL) < 0) {
+        jlog("probe_failed", "\"message\":\"Cannot connect\"");
+        goto end;
+    }
+    if (avformat_write_header(oc, NULL) < 0) goto end;
+
+    vf->format = AV_PIX_FMT_YUV420P;
+    vf->width  = g_cfg.out_width;
+    vf->height = g_cfg.out_height;
+    af->format = AV_SAMPLE_FMT_FLTP;
+    af->nb_samples     = ac->frame_size > 0 ? ac->frame_size : 1024;
+    af->channel_layout = AV_CH_LAYOUT_STEREO;
+    af->channels       = g_cfg.out_channels;
+    af->sample_rate    = g_cfg.sample_rate;
+    if (av_frame_get_buffer(vf, 0) < 0 || av_frame_get_buffer(af, 0) < 0) goto end;
+    for (int ch = 0; ch < g_cfg.out_channels; ch++)
+        memset(af->data[ch], 0, af->nb_samples * sizeof(float));
+    jlog("probe_sending", NULL);
+
+    int64_t epoch = mono_ns(), audio_pts = 0;
+    ret = 0;
+    for (int64_t n = 0; g_running && ret >= 0; n++) {
+        int64_t deadline = epoch + av_rescale(n, 1000000000LL * g_cfg.out_rate.den,
+                                              g_cfg.out_rate.num);
+        struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && g_running)
+            ;
+        if ((ret = av_frame_make_writable(vf)) < 0) break;
+        memset(vf->data[0], 96, (size_t)vf->linesize[0] * vf->height);
+        memset(vf->data[1], 128, (size_t)vf->linesize[1] * (vf->height / 2));
+        memset(vf->data[2], 128, (size_t)vf->linesize[2] * (vf->height / 2));
+        probe_paint(vf->data[0], vf->linesize[0], vf->width, av_gettime());
+        vf->pts = n;
+        ret = probe_write(oc, vc, vs, vf, pkt);
+
+        int64_t target = av_rescale(n + 1, (int64_t)g_cfg.sample_rate * g_cfg.out_rate.den,
+                                    g_cfg.out_rate.num);
+        while (ret >= 0 && audio_pts < target) {
+            af->pts = audio_pts;
+            audio_pts += af->nb_samples;
+            ret = probe_write(oc, ac, as, af, pkt);
+        }
+    }
+    if (ret < 0)
+        jlog("probe_failed", "\"message\":\"Connection lost\"");
+    av_write_trailer(oc);
+
+end:
+    if (oc) {
+        avio_closep(&oc->pb);
+        avformat_free_context(oc);
     }
+    avcodec_free_context(&vc);
+    avcodec_free_context(&ac);
+    av_frame_free(&vf);
+    av_frame_free(&af);
     av_packet_free(&pkt);
+    return ret;
+}
+
+/* ================================================================== */
+/*  Benchmark — --bench <file.ts>: unpaced, null output, JSON report   */
+/* ================================================================== */
+
+static int64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* End of main_loop: freeze the clocks before shutdown work starts */
+static void bench_finish(AppState *app) {
+    BenchStats *b = &app->bench;
+    b->end_us      = av_gettime_relative();
+    b->main_cpu_ns = thread_cpu_ns();
+    getrusage(RUSAGE_SELF, &b->usage);
+}
+
+/* One JSON line on stdout (the output itself went to /dev/null). CPU
+ * that is neither main_loop nor SRT decode is mostly x264's threads. */
+static void bench_report(AppState *app) {
+    BenchStats *b = &app->bench;
+    int64_t frames = app->out.frames;
+    double wall  = (b->end_us - b->start_us) / 1e6;
+    double user  = b->usage.ru_utime.tv_sec + b->usage.ru_utime.tv_usec / 1e6;
+    double sys   = b->usage.ru_stime.tv_sec + b->usage.ru_stime.tv_usec / 1e6;
+    double cpu   = user + sys;
+    double main_s = b->main_cpu_ns / 1e9, srt_s = app->shared.cpu_ns / 1e9;
+    double fps   = wall > 0 ? frames / wall : 0.0;
+    double target = av_q2d(g_cfg.out_rate);
+    int64_t ticks = b->ticks > 0 ? b->ticks : 1;
+
+    char stages[256];
+    int n = 0;
+    for (int i = 0; i < ST_COUNT; i++)
+        n += snprintf(stages + n, sizeof(stages) - n, "%s\"%s\":%.3f", i ? "," : "",
+                      stage_names[i], b->stage_us[i] / 1e3 / ticks);
+
+    printf("{\"bench\":{\"input\":\"%s\",\"resolution\":\"%dx%d\",\"target_fps\":%.3f,"
+           "\"profile\":\"%s\",\"preset\":\"%s\",\"frames\":%lld,\"wall_s\":%.3f,"
+           "\"fps\":%.2f,\"realtime_x\":%.2f,\"stage_ms\":{%s},"
+           "\"cpu_s\":{\"total\":%.3f,\"user\":%.3f,\"sys\":%.3f,\"main\":%.3f,"
+           "\"srt\":%.3f,\"other\":%.3f},\"cpu_ms_per_frame\":%.3f,"
+           "\"cores_per_stream\":%.3f,\"peak_rss_kb\":%ld}}\n",
+           g_cfg.bench_input, g_cfg.out_width, g_cfg.out_height, target,
+           g_cfg.enc.name, g_cfg.enc.preset, (long long)frames, wall,
+           fps, fps / target, stages,
+           cpu, user, sys, main_s, srt_s, cpu - main_s - srt_s,
+           frames ? cpu * 1e3 / frames : 0.0,
+           frames ? cpu / (frames / target) : 0.0, b->usage.ru_maxrss);
+    fflush(stdout);
+}
+
+/* ================================================================== */
+/*  Hardware counters — perf_counters: per-thread perf_event_open      */
+/* ================================================================== */
+
+static const char *const perf_names[PC_COUNT] = { "cycles", "instructions", "llc_misses" };
+
+/* Counts user space of one thread of this process only, which the
+ * default perf_event_paranoid (2) allows without privileges. Cache misses
+ * are the generic event, last-level misses on x86 and most ARM cores. */
+static int perf_open(pid_t tid, enum PerfCounter c) {
+    static const uint64_t config[PC_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    };
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.size           = sizeof(a);
+    a.type           = PERF_TYPE_HARDWARE;
+    a.config         = config[c];
+    a.exclude_kernel = 1;
+    a.exclude_hv     = 1;
+    a.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &a, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Scaled up for the time the PMU multiplexed the counter out */
+static int perf_read(int fd, double *value) {
+    uint64_t v[3];   /* value, time enabled, time running */
+    if (read(fd, v, sizeof(v)) != (ssize_t)sizeof(v)) return -1;
+    *value = v[2] ? (double)v[0] * v[1] / v[2] : 0.0;
+    return 0;
+}
+
+static int perf_ctx_switches(pid_t tid, long ctx[2]) {
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)tid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int found = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %ld", &ctx[0]) == 1) found++;
+        else if (sscanf(line, "nonvoluntary_ctxt_switches: %ld", &ctx[1]) == 1) found++;
+    }
+    fclose(f);
+    return found == 2 ? 0 : -1;
+}
+
+/* Counters that can't be opened (no PMU in a VM, perf_event_paranoid 3,
+ * seccomp) stay -1 and are reported as null; one event says why */
+static void perf_attach(ThreadCounters *t, pid_t tid, const char *thread) {
+    int opened = 0, err = 0;
+    t->tid = tid;
+    for (int c = 0; c < PC_COUNT; c++) {
+        t->fd[c] = perf_open(tid, (enum PerfCounter)c);
+        if (t->fd[c] >= 0 && perf_read(t->fd[c], &t->last[c]) == 0) {
+            opened++;
+        } else {
+            if (!err) err = t->fd[c] >= 0 ? EIO : errno;
+            if (t->fd[c] >= 0) close(t->fd[c]);
+            t->fd[c] = -1;
+        }
+    }
+    perf_ctx_switches(tid, t->last_ctx);
+    if (opened < PC_COUNT) {
+        char extra[192];
+        snprintf(extra, sizeof(extra), "\"thread\":\"%s\",\"opened\":%d,\"message\":\"%s\"",
+                 thread, opened, strerror(err));
+        jlog("perf_counters_unavailable", extra);
+    }
+}
+
+/* "thread":{...} with deltas since the previous call */
+static int perf_thread_json(ThreadCounters *t, const char *thread, char *buf, size_t size) {
+    double d[PC_COUNT];
+    int have[PC_COUNT];
+    int n = snprintf(buf, size, "\"%s\":{", thread);
+    for (int c = 0; c < PC_COUNT; c++) {
+        double v;
+        have[c] = t->fd[c] >= 0 && perf_read(t->fd[c], &v) == 0;
+        d[c] = have[c] ? v - t->last[c] : 0.0;
+        if (have[c]) t->last[c] = v;
+        if (have[c]) n += snprintf(buf + n, size - n, "\"%s\":%.0f,", perf_names[c], d[c]);
+        else         n += snprintf(buf + n, size - n, "\"%s\":null,", perf_names[c]);
+    }
+    if (have[PC_CYCLES] && have[PC_INSTRUCTIONS] && d[PC_CYCLES] > 0)
+        n += snprintf(buf + n, size - n, "\"ipc\":%.2f,", d[PC_INSTRUCTIONS] / d[PC_CYCLES]);
+    if (have[PC_LLC_MISSES] && have[PC_INSTRUCTIONS] && d[PC_INSTRUCTIONS] > 0)
+        n += snprintf(buf + n, size - n, "\"llc_mpki\":%.2f,",
+                      d[PC_LLC_MISSES] * 1000.0 / d[PC_INSTRUCTIONS]);
+    long ctx[2];
+    if (perf_ctx_switches(t->tid, ctx) == 0) {
+        n += snprintf(buf + n, size - n, "\"ctx_switches\":{\"voluntary\":%ld,\"involuntary\":%ld},",
+                      ctx[0] - t->last_ctx[0], ctx[1] - t->last_ctx[1]);
+        t->last_ctx[0] = ctx[0];
+        t->last_ctx[1] = ctx[1];
+    }
+    n--;   /* trailing comma */
+    return n + snprintf(buf + n, size - n, "}");
+}
+
+/* "perf":{"main":{...},"srt":{...}}, for emit_stats. The SRT thread
+ * is attached once it has published its thread id. */
+static int perf_stats_json(AppState *app, char *buf, size_t size) {
+    PerfCounters *p = &app->perf;
+    pid_t srt_tid = atomic_load(&app->shared.tid);
+    if (!p->srt.tid && srt_tid)
+        perf_attach(&p->srt, srt_tid, "srt");
+
+    int n = snprintf(buf, size, "\"perf\":{");
+    n += perf_thread_json(&p->main, "main", buf + n, size - n);
+    if (p->srt.tid) {
+        n += snprintf(buf + n, size - n, ",");
+        n += perf_thread_json(&p->srt, "srt", buf + n, size - n);
+    }
+    n += snprintf(buf + n, size - n, "},");
+    return n;
+}
+
+static void perf_close(PerfCounters *p) {
+    ThreadCounters *threads[2] = { &p->main, &p->srt };
+    for (int i = 0; i < 2; i++) {
+        for (int c = 0; threads[i]->tid && c < PC_COUNT; c++)
+            if (threads[i]->fd[c] >= 0) close(threads[i]->fd[c]);
+        threads[i]->tid = 0;
+    }
+}
+
+/* ================================================================== */
+/*  Simulation — --simulate <scenario>: scripted SRT sender, virtual   */
+/*  clock, switch latency report                                       */
+/* ================================================================== */
+
+/* One event per line, "<seconds> <command> [loss%]", '#' comments:
+ *   1     connect            sender connects and streams
+ *   10    drop               sender goes silent, found by srt_timeout_us
+ *   12.5  connect loss=5     reconnects, 5% of packets lost
+ *   20    loss 0             loss changes mid-stream
+ *   25    close              connection closed, found at once
+ *   30    end
+ * Without "end" the run stops long enough after the last event for a
+ * trailing drop to play out. */
+static int sim_load(SimState *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        jlog("error", "\"message\":\"Cannot open scenario\"");
+        return -1;
+    }
+    static const char *const names[] = { "connect", "drop", "close", "loss", "end" };
+    char line[256], extra[96];
+    int lineno = 0;
+    int64_t last = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        double t;
+        char cmd[16], arg[64] = "";
+        int n = sscanf(line, "%lf %15s %63s", &t, cmd, arg);
+        if (n == EOF) continue;
+        SimEvent *e = &s->ev[s->count];
+        int c = 0;
+        while (n >= 2 && c <= SIM_END && strcmp(cmd, names[c]) != 0) c++;
+        if (n < 2 || c > SIM_END || t * 1e6 < last || s->count == SIM_EVENTS) {
+            snprintf(extra, sizeof(extra), "\"message\":\"Bad scenario line %d\"", lineno);
+            jlog("error", extra);
+            fclose(f);
+            return -1;
+        }
+        const char *v = strncmp(arg, "loss=", 5) == 0 ? arg + 5 : arg;
+        double loss = atof(v) / 100.0;
+        e->at_us = last = llrint(t * 1e6);
+        e->cmd   = (enum SimCmd)c;
+        e->loss  = loss < 0 ? 0 : loss > 1 ? 1 : loss;
+        s->count++;
+    }
+    fclose(f);
+    if (!s->count) {
+        jlog("error", "\"message\":\"Empty scenario\"");
+        return -1;
+    }
+    if (s->ev[s->count - 1].cmd != SIM_END) {
+        if (s->count == SIM_EVENTS) s->count--;
+        s->ev[s->count++] = (SimEvent){
+            .at_us = last + g_cfg.srt_timeout_us +
+                     (int64_t)(g_cfg.bg_unmute_delay * 1e6) + 1000000,
+            .cmd = SIM_END };
+    }
+
+    if (av_image_alloc(s->pic, s->linesize, g_cfg.out_width, g_cfg.out_height,
+                       AV_PIX_FMT_YUV420P, 1) < 0 ||
+        av_samples_alloc(s->tone, NULL, g_cfg.out_channels, SIM_AUDIO_CHUNK,
+                         AV_SAMPLE_FMT_FLTP, 0) < 0)
+        return -1;
+    memset(s->pic[1], 128, (size_t)s->linesize[1] * (g_cfg.out_height / 2));
+    memset(s->pic[2], 128, (size_t)s->linesize[2] * (g_cfg.out_height / 2));
+    s->rng = 0x9E3779B97F4A7C15ULL;     /* fixed seed: runs are repeatable */
+    s->last_audio = AUDIO_BG;
+    g_sim_now_us = 0;
+    return 0;
+}
+
+/* Flat grey stepping with the picture number, so every picture differs */
+static void sim_paint(SimState *s, int64_t n) {
+    memset(s->pic[0], 16 + (int)(n * 4 % 220), (size_t)s->linesize[0] * g_cfg.out_height);
+}
+
+/* xorshift64: the same loss pattern on every run */
+static int sim_lost(SimState *s) {
+    s->rng ^= s->rng << 13;
+    s->rng ^= s->rng >> 7;
+    s->rng ^= s->rng << 17;
+    return s->loss > 0 && (s->rng >> 11) * (1.0 / 9007199254740992.0) < s->loss;
+}
+
+static void sim_apply(AppState *app, const SimEvent *e) {
+    SimState  *s  = app->sim;
+    SrtShared *sh = &app->shared;
+    SimResult *r  = &s->res[e - s->ev];
+    r->detect_us = r->video_us = r->audio_us = -1;
+    r->av_min_ms = 1e9;
+    r->av_max_ms = -1e9;
+
+    switch (e->cmd) {
+    case SIM_CONNECT:
+        if (!s->open) {
+            jlog("srt_connected", "\"resolution\":\"simulated\"");
+            srt_set_connected(sh);
+            s->open = 1;
+        }
+        s->sending    = 1;
+        s->loss       = e->loss;
+        s->origin_us  = g_sim_now_us;
+        s->video_sent = s->audio_sent = 0;
+        break;
+    case SIM_DROP:
+        s->sending = 0;
+        break;
+    case SIM_CLOSE:
+        s->sending = 0;
+        if (s->open) {
+            s->open = 0;
+            srt_set_dropped(sh, "read_error");
+        }
+        break;
+    case SIM_LOSS:
+        s->loss = e->loss;
+        break;
+    case SIM_END:
+        break;
+    }
+}
+
+/* Start of a tick: set the virtual clock, apply due events and let the
+ * sender publish what it would have delivered by now (pictures at the
+ * output rate, audio in SIM_AUDIO_CHUNK packets). Returns 0 at "end". */
+static int sim_step(AppState *app) {
+    SimState  *s  = app->sim;
+    SrtShared *sh = &app->shared;
+    if (s->tick == 0)
+        s->start_us = av_gettime_relative();
+    int64_t now = g_sim_now_us = av_rescale(s->tick, 1000000LL * g_cfg.out_rate.den,
+                                            g_cfg.out_rate.num);
+    while (s->next < s->count && s->ev[s->next].at_us <= now) {
+        if (s->ev[s->next].cmd == SIM_END) return 0;
+        sim_apply(app, &s->ev[s->next++]);
+    }
+
+    if (s->open && s->sending) {
+        int64_t elapsed = now - s->origin_us;
+        int64_t pics = av_rescale(elapsed, g_cfg.out_rate.num,
+                                  1000000LL * g_cfg.out_rate.den) + 1;
+        while (s->video_sent < pics) {
+            if (!sim_lost(s)) {
+                sim_paint(s, s->video_sent);
+                srt_publish_video(sh, s->pic, s->linesize, 0, 0, 0);
+            }
+            s->video_sent++;
+        }
+        int64_t samples = elapsed * g_cfg.sample_rate / 1000000;
+        while (s->audio_sent + SIM_AUDIO_CHUNK <= samples) {
+            if (!sim_lost(s)) {
+                for (int i = 0; i < SIM_AUDIO_CHUNK; i++) {
+                    float v = 0.25f * (float)sin(2 * M_PI * 440 * (s->audio_sent + i) /
+                                                 g_cfg.sample_rate);
+                    for (int ch = 0; ch < g_cfg.out_channels && ch < 2; ch++)
+                        ((float *)s->tone[ch])[i] = v;
+                }
+                srt_publish_audio(sh, s->tone, SIM_AUDIO_CHUNK);
+            }
+            s->audio_sent += SIM_AUDIO_CHUNK;
+        }
+    }
+    /* A timed-out sender would have to reconnect: the script says when */
+    if (s->open && srt_timed_out(sh)) {
+        s->open = s->sending = 0;
+        srt_set_dropped(sh, "timeout");
+    }
+    return 1;
+}
+
+/* End of a tick: charge what the output did to the latest event */
+static void sim_observe(AppState *app, int srt_video, int srt_new, enum AudioMode audio_mode) {
+    SimState *s = app->sim;
+    int connected = app->shared.connected;   /* no SRT thread: main_loop owns it */
+    int64_t pad = app->stats.pad_samples;
+    if (s->next > 0) {
+        SimResult *r = &s->res[s->next - 1];
+        int64_t since = g_sim_now_us - s->ev[s->next - 1].at_us;
+        if (connected != s->last_connected && r->detect_us < 0)
+            r->detect_us = since;
+        if (srt_video != s->last_video && r->video_us < 0)
+            r->video_us = since;
+        if ((int)audio_mode != s->last_audio && audio_mode != AUDIO_GRACE && r->audio_us < 0)
+            r->audio_us = since;
+        if (srt_video && !srt_new)
+            r->frozen_ticks++;
+        r->pad_samples += pad - s->last_pad;
+        double av_ms = app->out.audio_pts * 1e3 / g_cfg.sample_rate -
+                       app->out.video_pts * 1e3 * g_cfg.out_rate.den / g_cfg.out_rate.num;
+        if (av_ms < r->av_min_ms) r->av_min_ms = av_ms;
+        if (av_ms > r->av_max_ms) r->av_max_ms = av_ms;
+    }
+    s->last_connected = connected;
+    s->last_video     = srt_video;
+    s->last_audio     = (int)audio_mode;
+    s->last_pad       = pad;
+    s->tick++;
+}
+
+static const char *sim_ms(char *buf, size_t size, int64_t us) {
+    if (us < 0) snprintf(buf, size, "null");
+    else        snprintf(buf, size, "%.1f", us / 1e3);
+    return buf;
+}
+
+/* One JSON line on stdout, one entry per event that was reached */
+static void sim_report(AppState *app) {
+    static const char *const names[] = { "connect", "drop", "close", "loss", "end" };
+    SimState *s = app->sim;
+    double virt = g_sim_now_us / 1e6;
+    double wall = (s->end_us - s->start_us) / 1e6;
+    double frame_ms = 1e3 * g_cfg.out_rate.den / g_cfg.out_rate.num;
+
+    printf("{\"simulate\":{\"script\":\"%s\",\"virtual_s\":%.3f,\"wall_s\":%.3f,"
+           "\"speedup\":%.1f,\"ticks\":%lld,\"events\":[",
+           g_cfg.sim_script, virt, wall, wall > 0 ? virt / wall : 0.0, (long long)s->tick);
+    for (int i = 0; i < s->next; i++) {
+        const SimEvent  *e = &s->ev[i];
+        const SimResult *r = &s->res[i];
+        char d[32], v[32], a[32], av[64];
+        if (r->av_min_ms <= r->av_max_ms)
+            snprintf(av, sizeof(av), "[%.1f,%.1f]", r->av_min_ms, r->av_max_ms);
+        else
+            snprintf(av, sizeof(av), "null");
+        printf("%s{\"t\":%.3f,\"event\":\"%s\",\"loss_pct\":%.1f,\"detect_ms\":%s,"
+               "\"video_ms\":%s,\"audio_ms\":%s,\"frozen_ms\":%.1f,\"silence_ms\":%.1f,"
+               "\"av_offset_ms\":%s}",
+               i ? "," : "", e->at_us / 1e6, names[e->cmd], e->loss * 100,
+               sim_ms(d, sizeof(d), r->detect_us), sim_ms(v, sizeof(v), r->video_us),
+               sim_ms(a, sizeof(a), r->audio_us), r->frozen_ticks * frame_ms,
+               r->pad_samples * 1e3 / g_cfg.sample_rate, av);
+    }
+    printf("]}}\n");
+    fflush(stdout);
+}
+
+static void sim_free(SimState *s) {
+    av_freep(&s->pic[0]);
+    av_freep(&s->tone[0]);
+    free(s);
 }
 
 /* ================================================================== */
@@ -522,40 +3838,85 @@ static void encode_one_audio_frame(AppState *app, AVAudioFifo *fifo, int aframe_
 
 static void main_loop(AppState *app) {
     SrtShared *sh = &app->shared;
-    int64_t frame_dur = 1000000 / g_cfg.out_fps;
+    FrameClock clk;
     int aframe_sz = app->out.audio_enc_ctx->frame_size;
     if (aframe_sz <= 0) aframe_sz = 1024;
     int64_t bg_unmute_us = (int64_t)(g_cfg.bg_unmute_delay * 1e6);
 
     int was_srt_video = 0;
+    enum VideoSrc last_src = SRC_NONE;
+    uint64_t last_srt_seq = 0;
     enum AudioMode audio_mode = AUDIO_BG;
     int64_t srt_drop_time = 0;
     int64_t stats_ticker = 0;
+    int bench = g_cfg.bench_input[0] != 0;
+    int sim = app->sim != NULL;
+    TickStats tstats;
+    memset(&tstats, 0, sizeof(tstats));
 
     jlog("running", NULL);
+    TRACE_THREAD("main");
+    if (g_cfg.perf_counters)
+        perf_attach(&app->perf.main, (pid_t)syscall(SYS_gettid), "main");
+    fclock_init(&clk, g_cfg.out_rate);
+    tstats.start_us = av_gettime_relative();
+    app->bench.start_us = tstats.start_us;
 
     while (g_running) {
-        int64_t t0 = av_gettime_relative();
+        int64_t t_tick = av_gettime_relative(), stage_us[ST_COUNT];
+        TRACE_BEGIN(tr_tick);
+        control_poll(app);
+        if (sim && !sim_step(app)) break;
 
-        /* ---- Always decode background ---- */
+        /* Governor half rate: every other tick repeats the last picture */
+        int gov_repeat = app->gov.level >= GOV_HALF_RATE && (clk.tick & 1) &&
+                         last_src != SRC_NONE;
+
+        /* ---- Decode background (a still is decoded once; the governor
+         *      may skip it while SRT covers the screen) ---- */
         int have_bg = 0;
-        for (int i = 0; i < 5 && !have_bg; i++) {
-            int r = read_bg_frame(&app->bg, app->bg_frame, app->bg_audio_fifo);
-            if (r == 1) have_bg = 1;
-            else if (r < 0) { loop_bg(&app->bg); }
+        int skip_bg = app->gov.level >= GOV_SKIP_BG && was_srt_video;
+        if (!skip_bg && !(app->bg_still && app->bg_frame->data[0])) {
+            for (int i = 0; i < 5 && !have_bg; i++) {
+                int r = read_bg_frame(&app->bg, app->bg_frame, app->bg_audio_fifo);
+                if (r == 1) have_bg = 1;
+                else if (r < 0) { loop_bg(&app->bg); }
+            }
         }
+        int64_t t_bg = av_gettime_relative();
+        stage_us[ST_BG_DECODE] = t_bg - t_tick;
 
-        /* ---- Check SRT shared buffer ---- */
-        int use_srt_video = 0;
+        /* ---- Check SRT shared buffer (copy only a picture we haven't sent) ---- */
+        int use_srt_video = 0, srt_new = 0;
+        ProbeMark mark = {0};
+        TRACE_BEGIN(tr_copy);
         pthread_mutex_lock(&sh->lock);
+        while (bench && g_running &&
+               !(sh->connected && sh->has_video && sh->video_seq != last_srt_seq))
+            pthread_cond_wait(&sh->cond, &sh->lock);
+        if (bench && !g_running) {
+            /* Stopped or the SRT thread gave up: no picture is coming */
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
         if (sh->connected && sh->has_video) {
-            av_frame_make_writable(app->out_frame);
-            av_image_copy(app->out_frame->data, app->out_frame->linesize,
-                          (const uint8_t **)sh->video_data, sh->video_linesize,
-                          AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
+            if (!gov_repeat && (sh->video_seq != last_srt_seq || last_src != SRC_SRT)) {
+                av_frame_make_writable(app->out_frame);
+                av_image_copy(app->out_frame->data, app->out_frame->linesize,
+                              (const uint8_t **)sh->video_data, sh->video_linesize,
+                              AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
+                last_srt_seq = sh->taken_seq = sh->video_seq;
+                mark = sh->probe;
+                srt_new = 1;
+                if (bench)
+                    pthread_cond_signal(&sh->cond);
+            }
             use_srt_video = 1;
         }
         pthread_mutex_unlock(&sh->lock);
+        TRACE_END(tr_copy, "srt_copy");
+        int64_t t_srt = av_gettime_relative();
+        stage_us[ST_SRT_COPY] = t_srt - t_bg;
 
         /* ---- Audio mode state machine ---- */
         if (use_srt_video) {
@@ -566,12 +3927,12 @@ static void main_loop(AppState *app) {
             }
         } else {
             if (audio_mode == AUDIO_SRT) {
-                srt_drop_time = av_gettime_relative();
+                srt_drop_time = clock_us();
                 audio_mode = AUDIO_GRACE;
                 jlog("srt_grace", NULL);
             }
             if (audio_mode == AUDIO_GRACE) {
-                int64_t since_drop = av_gettime_relative() - srt_drop_time;
+                int64_t since_drop = clock_us() - srt_drop_time;
                 if (since_drop > bg_unmute_us) {
                     audio_mode = AUDIO_BG;
                     jlog("bg_audio_on", NULL);
@@ -579,22 +3940,47 @@ static void main_loop(AppState *app) {
             }
         }
 
-        if (use_srt_video && !was_srt_video)
+        if (use_srt_video && !was_srt_video) {
             jlog("video_srt", NULL);
-        else if (!use_srt_video && was_srt_video)
+            request_idr(&app->out);
+        } else if (!use_srt_video && was_srt_video) {
             jlog("video_bg", NULL);
+            request_idr(&app->out);
+        }
         was_srt_video = use_srt_video;
+        rate_update(&app->out, use_srt_video);
 
-        /* ---- Video output ---- */
-        if (use_srt_video) {
+        /* ---- Video output ----
+         * When nothing new arrived, out_frame already holds the last picture
+         * and is re-sent untouched: x264 codes an identical input as an
+         * all-skip P-frame, and no copy or scale happens for the tick. */
+        int bg_new = have_bg && app->bg_frame->data[0];
+        if (app->bg_still && app->bg_frame->data[0])
+            bg_new = last_src != SRC_BG;   /* only when the still comes on screen */
+
+        if (gov_repeat) {
+            app->stats.dup_gov++;
+            encode_write_video(&app->out, app->out_frame);
+        } else if (use_srt_video) {
+            if (!srt_new) app->stats.dup_srt++;
+            else if (mark.sent_us) probe_encode(&app->out, &mark);
             encode_write_video(&app->out, app->out_frame);
-        } else if (have_bg && app->bg_frame->data[0]) {
+            last_src = SRC_SRT;
+        } else if (bg_new) {
             av_frame_make_writable(app->out_frame);
             av_image_copy(app->out_frame->data, app->out_frame->linesize,
                           (const uint8_t **)app->bg_frame->data, app->bg_frame->linesize,
                           AV_PIX_FMT_YUV420P, g_cfg.out_width, g_cfg.out_height);
             encode_write_video(&app->out, app->out_frame);
+            last_src = SRC_BG;
+        } else if (last_src != SRC_NONE) {
+            app->stats.dup_bg++;
+            encode_write_video(&app->out, app->out_frame);
         }
+        if (last_src != SRC_NONE)
+            thumb_capture(&app->thumb, app->out_frame, app->out.video_pts);
+        int64_t t_video = av_gettime_relative();
+        stage_us[ST_VIDEO_ENC] = t_video - t_srt;
 
         /* ---- Audio ---- */
         {
@@ -621,7 +4007,9 @@ static void main_loop(AppState *app) {
                 }
             }
 
-            int64_t target_audio = (app->out.video_pts * (int64_t)g_cfg.sample_rate) / g_cfg.out_fps;
+            int64_t target_audio = av_rescale(app->out.video_pts,
+                                              (int64_t)g_cfg.sample_rate * g_cfg.out_rate.den,
+                                              g_cfg.out_rate.num);
             while (app->out.audio_pts < target_audio) {
                 switch (audio_mode) {
                 case AUDIO_SRT:
@@ -643,55 +4031,95 @@ static void main_loop(AppState *app) {
             }
             audio_done: ;
         }
+        int64_t t_audio = av_gettime_relative();
+        stage_us[ST_AUDIO_ENC] = t_audio - t_video;
+        delay_release(&app->out);
+        output_flush_tick(&app->out);
+        int64_t t_end = av_gettime_relative();
+        stage_us[ST_OUTPUT] = t_end - t_audio;
+        tick_stats_add(&tstats, stage_us, t_end - t_tick);
+        TRACE_END(tr_tick, "tick");
+
+        /* ---- Simulation: no stats or pacing, the next tick is one frame later ---- */
+        if (sim) {
+            sim_observe(app, use_srt_video, srt_new, audio_mode);
+            continue;
+        }
+
+        /* ---- Bench: no stats or pacing, stop after bench_frames ---- */
+        if (bench) {
+            app->bench.ticks++;
+            for (int i = 0; i < ST_COUNT; i++)
+                app->bench.stage_us[i] += stage_us[i];
+            if (app->out.frames >= g_cfg.bench_frames) break;
+            continue;
+        }
 
         /* ---- Stats every ~30 frames (1 second) ---- */
         stats_ticker++;
         if (stats_ticker >= (int64_t)g_cfg.out_fps) {
             stats_ticker = 0;
-            int srt_conn;
-            pthread_mutex_lock(&sh->lock);
-            srt_conn = sh->connected;
-            pthread_mutex_unlock(&sh->lock);
-            char extra[256];
-            snprintf(extra, sizeof(extra),
-                     "\"fps\":%d,\"srt_connected\":%s,\"audio_mode\":\"%s\"",
-                     g_cfg.out_fps,
-                     srt_conn ? "true" : "false",
-                     audio_mode == AUDIO_SRT ? "srt" :
-                     audio_mode == AUDIO_GRACE ? "grace" : "bg");
-            jlog("stats", extra);
+            if (app->gov.max_level)
+                governor_update(app, &clk);
+            emit_stats(app, &clk, &tstats, audio_mode);
         }
 
-        /* ---- Pace to target fps ---- */
-        int64_t dt = av_gettime_relative() - t0;
-        int64_t sl = frame_dur - dt;
-        if (sl > 1000) usleep((unsigned)sl);
+        /* ---- Pace to the next absolute deadline ---- */
+        if (app->gov.max_level)
+            governor_account(&app->gov, stage_us, t_end - t_tick);
+        int missed = fclock_wait(&clk);
+        if (missed > 0) {
+            switch (g_cfg.late_policy) {
+            case LATE_CATCHUP:
+                /* Deadlines are in the past, so the next ticks run back to back */
+                break;
+            case LATE_SKIP:
+                /* Give up the lost slots; audio fills the timestamp gap */
+                clk.tick += missed;
+                app->out.video_pts += missed;
+                break;
+            case LATE_DUPLICATE:
+                /* Re-send the last picture for each lost slot, no decode */
+                for (int i = 0; i < missed && g_running; i++) {
+                    encode_write_video(&app->out, app->out_frame);
+                    app->stats.dup_late++;
+                }
+                clk.tick += missed;
+                break;
+            }
+        }
+        metrics_tick(&app->metrics, &clk, stage_us, t_end - t_tick);
     }
+    if (bench)
+        bench_finish(app);
+    if (sim)
+        app->sim->end_us = av_gettime_relative();
     jlog("stopped", NULL);
 }
 
 /* ================================================================== */
-/*  main                                                               */
+/*  main — left out when another program includes this file            */
+/*  (microbench.c)                                                     */
 /* ================================================================== */
+#ifndef SRT_COMPOSITOR_NO_MAIN
 int main(int argc, char **argv) {
-    /* Set defaults */
-    g_cfg.out_width       = 1280;
-    g_cfg.out_height      = 720;
-    g_cfg.out_fps         = 30;
-    g_cfg.video_bitrate   = 4000000;
-    g_cfg.audio_bitrate   = 128000;
-    g_cfg.sample_rate     = 48000;
-    g_cfg.bg_unmute_delay = 5.0;
-    g_cfg.out_channels    = 2;
-    g_cfg.srt_timeout_us  = 2000000;
-    g_cfg.srt_retry_us    = 500000;
-    strncpy(g_cfg.bg_file, "background.mp4", sizeof(g_cfg.bg_file) - 1);
+    config_defaults();
 
     /* Parse arguments */
-    const char *config_path = NULL;
+    const char *config_path = NULL, *probe_url = NULL;
+    char bench_input[2048] = "", sim_script[2048] = "";
+    int64_t bench_frames = 0;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
             config_path = argv[++i];
+        } else if (strcmp(argv[i], "--probe-send") == 0 && i + 1 < argc) {
+            probe_url = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            snprintf(bench_input, sizeof(bench_input), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc) {
+            bench_frames = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            snprintf(sim_script, sizeof(sim_script), "%s", argv[++i]);
         } else if (argv[i][0] != '-' && !g_cfg.srt_url[0]) {
             /* Legacy positional: srt_url */
             strncpy(g_cfg.srt_url, argv[i], sizeof(g_cfg.srt_url) - 1);
@@ -704,10 +4132,38 @@ int main(int argc, char **argv) {
     if (config_path) {
         if (load_config(config_path) < 0) return 1;
     }
+    /* After the config, which would otherwise reset them */
+    if (bench_input[0]) {
+        strcpy(g_cfg.bench_input, bench_input);
+        g_cfg.bench_frames = bench_frames > 0 ? bench_frames : 60LL * g_cfg.out_fps;
+    }
+    if (sim_script[0])
+        strcpy(g_cfg.sim_script, sim_script);
+    g_cfg.null_output = bench_input[0] || sim_script[0];
+
+    /* Everything after this logs through the logger thread */
+    if (log_start() < 0) return 1;
+#ifdef SRT_TRACE
+    if (g_cfg.trace_path[0] && trace_start() < 0)
+        jlog("trace_failed", "\"message\":\"Cannot start trace thread\"");
+#else
+    if (g_cfg.trace_path[0])
+        jlog("trace_failed", "\"message\":\"trace_path needs a TRACE=1 build\"");
+#endif
+
+    if (probe_url) {
+        signal(SIGINT, signal_handler);
+        signal(SIGPIPE, SIG_IGN);
+        return probe_send(probe_url) < 0 ? 1 : 0;
+    }
 
-    if (!g_cfg.srt_url[0]) {
+    if (!g_cfg.srt_url[0] && !g_cfg.bench_input[0] && !g_cfg.sim_script[0]) {
         fprintf(stderr, "Usage: %s --config <config.json>\n", argv[0]);
         fprintf(stderr, "   or: %s <srt_url> [background.mp4]  (legacy)\n", argv[0]);
+        fprintf(stderr, "   or: %s [--config <config.json>] --probe-send <srt_url>\n", argv[0]);
+        fprintf(stderr, "   or: %s [--config <config.json>] --bench <input.ts> [--bench-frames N]\n",
+                argv[0]);
+        fprintf(stderr, "   or: %s [--config <config.json>] --simulate <scenario.txt>\n", argv[0]);
         return 1;
     }
 
@@ -718,8 +4174,14 @@ int main(int argc, char **argv) {
 
     AppState app;
     memset(&app, 0, sizeof(app));
+    app.ctl_fd = -1;
+    app.metrics.fd = -1;
+    app.gov.max_level = g_cfg.bench_input[0] || g_cfg.sim_script[0] ?
+                        0 : g_cfg.governor_max_level;
+    atomic_init(&app.sws_flags, SWS_BILINEAR);
 
     pthread_mutex_init(&app.shared.lock, NULL);
+    pthread_cond_init(&app.shared.cond, NULL);
     av_image_alloc(app.shared.video_data, app.shared.video_linesize,
                    g_cfg.out_width, g_cfg.out_height, AV_PIX_FMT_YUV420P, 1);
     app.shared.audio_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP,
@@ -738,6 +4200,11 @@ int main(int argc, char **argv) {
     app.srt_local_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP,
                                               g_cfg.out_channels, g_cfg.sample_rate * 2);
 
+    if (g_cfg.sim_script[0]) {
+        app.sim = calloc(1, sizeof(*app.sim));
+        if (!app.sim || sim_load(app.sim, g_cfg.sim_script) < 0)
+            return 1;
+    }
     if (open_background(&app) < 0) {
         jlog("error", "\"message\":\"Background open failed\"");
         return 1;
@@ -747,25 +4214,53 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    if (pthread_create(&app.srt_thread, NULL, srt_thread_func, &app) != 0) {
-        jlog("error", "\"message\":\"Thread create failed\"");
-        return 1;
+    if (g_cfg.thumb_path[0] && thumb_open(&app.thumb) < 0) {
+        jlog("thumb_failed", "\"message\":\"Cannot start thumbnail encoder\"");
+        thumb_close(&app.thumb);
     }
+    if (g_cfg.control_socket[0] && control_open(&app) < 0)
+        jlog("error", "\"message\":\"Cannot open control socket\"");
+    if (g_cfg.metrics_socket[0] && metrics_open(&app) < 0)
+        jlog("error", "\"message\":\"Cannot open metrics socket\"");
 
-    main_loop(&app);
+    /* Under --simulate the scenario sender runs inside main_loop. If the
+     * SRT thread can't start, the writer, recorder, thumbnail and control
+     * threads are already running: stop them through the normal shutdown. */
+    int failed = 0;
+    if (!app.sim && pthread_create(&app.srt_thread, NULL, srt_thread_func, &app) != 0) {
+        jlog("error", "\"message\":\"Thread create failed\"");
+        failed = 1;
+    } else {
+        main_loop(&app);
+    }
 
+    pthread_mutex_lock(&app.shared.lock);
     g_running = 0;
-    pthread_join(app.srt_thread, NULL);
+    pthread_cond_broadcast(&app.shared.cond);
+    pthread_mutex_unlock(&app.shared.lock);
+    if (!app.sim && !failed)
+        pthread_join(app.srt_thread, NULL);
+    perf_close(&app.perf);
+    if (g_cfg.bench_input[0] && !failed) {
+        if (app.out.frames)
+            bench_report(&app);
+        else
+            failed = 1;   /* input unusable; the SRT thread logged why */
+    }
+    if (app.sim) {
+        sim_report(&app);
+        sim_free(app.sim);
+    }
+#ifdef SRT_TRACE
+    trace_stop();
+#endif
 
+    control_close(&app);
+    metrics_close(&app.metrics);
+    thumb_close(&app.thumb);
     close_source(&app.bg);
-    if (app.out.fmt_ctx) {
-        av_write_trailer(app.out.fmt_ctx);
-        avcodec_free_context(&app.out.video_enc_ctx);
-        avcodec_free_context(&app.out.audio_enc_ctx);
-        if (!(app.out.fmt_ctx->oformat->flags & AVFMT_NOFILE))
-            avio_closep(&app.out.fmt_ctx->pb);
-        avformat_free_context(app.out.fmt_ctx);
-    }
+    output_flush_tick(&app.out);
+    close_output(&app.out);
     av_frame_free(&app.bg_frame);
     av_frame_free(&app.out_frame);
     av_audio_fifo_free(app.bg_audio_fifo);
@@ -773,7 +4268,9 @@ int main(int argc, char **argv) {
     av_freep(&app.shared.video_data[0]);
     av_audio_fifo_free(app.shared.audio_fifo);
     pthread_mutex_destroy(&app.shared.lock);
+    pthread_cond_destroy(&app.shared.cond);
 
     jlog("done", NULL);
-    return 0;
+    return failed;
 }
+#endif /* SRT_COMPOSITOR_NO_MAIN */
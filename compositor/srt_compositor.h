@@ -14,7 +14,20 @@
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
+#include <errno.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -30,6 +43,27 @@
 /*  Types                                                              */
 /* ================================================================== */
 
+/* Rate control modes for the H.264 encoder */
+enum RcMode { RC_ABR, RC_CRF, RC_CBR };
+
+/* Named x264 encoder profile ("encoder_profiles" section of the config) */
+typedef struct {
+    char   name[64];
+    char   preset[32];
+    char   tune[64];         /* "" = no tune */
+    char   profile[16];      /* H.264 profile */
+    int    rc_mode;          /* enum RcMode */
+    int    crf;
+    int    bitrate;          /* 0 = Config.video_bitrate */
+    int    maxrate;          /* VBV, 0 = unset */
+    int    bufsize;
+    int    threads;          /* 0 = auto */
+    int    sliced_threads;   /* 1 = slice threads, 0 = frame threads */
+    int    intra_refresh;
+    double gop_seconds;
+    int    lookahead;        /* rc-lookahead frames, -1 = preset default */
+} EncoderProfile;
+
 /* Runtime configuration (loaded from JSON) */
 typedef struct {
     char   srt_url[2048];
@@ -37,7 +71,9 @@ typedef struct {
     char   stream_id[256];
     int    out_width;
     int    out_height;
-    int    out_fps;
+    int    out_fps;          /* nominal integer rate (stats cadence, GOP) */
+    AVRational out_rate;     /* exact frame rate, e.g. 30000/1001 */
+    int    late_policy;      /* enum LatePolicy */
     int    video_bitrate;
     int    audio_bitrate;
     int    sample_rate;
@@ -45,6 +81,35 @@ typedef struct {
     int    out_channels;
     int64_t srt_timeout_us;
     int64_t srt_retry_us;
+    double idr_min_interval; /* seconds between forced IDRs */
+    int    out_queue_kb;     /* bound of the stdout packet queue */
+    char   record_path[2048];  /* "" = no local recording; strftime() expanded */
+    char   record_format[16];  /* "mp4" (fragmented) or "mpegts" */
+    int    record_queue_kb;
+    int    bg_video_bitrate;   /* rate while the background shows, 0 = full rate */
+    double bitrate_ramp;       /* seconds to ramp down to bg_video_bitrate */
+    int    mux_mode;           /* enum MuxMode */
+    char   shm_ring_path[1024];  /* "" = no shared-memory output */
+    int    shm_ring_kb;
+    double delay_seconds;      /* broadcast delay at startup, 0 = live */
+    double delay_max_seconds;  /* upper bound for runtime delay changes */
+    char   control_socket[108];  /* "" = no control socket (sun_path size) */
+    double replay_seconds;     /* instant-replay window, 0 = off */
+    int    replay_max_kb;      /* byte budget of the replay ring */
+    char   replay_path[2048];  /* default clip path, strftime() expanded */
+    char   thumb_path[2048];   /* "" = no dashboard thumbnail */
+    double thumb_interval;     /* seconds between thumbnails */
+    int    thumb_width;        /* height follows the output aspect */
+    int    governor_max_level; /* deepest enum GovLevel allowed, 0 = off */
+    char   metrics_socket[108];  /* "" = no metrics endpoint (sun_path size) */
+    char   trace_path[2048];   /* Chrome trace dumps, strftime() expanded; needs TRACE=1 */
+    int    latency_probe;      /* read --probe-send time marks from SRT pictures */
+    int    perf_counters;      /* per-thread hardware counters in stats */
+    char   bench_input[2048];  /* --bench: local TS replacing SRT, unpaced, null output */
+    int64_t bench_frames;      /* --bench-frames, 0 = 60 s of output */
+    char   sim_script[2048];   /* --simulate: scenario replacing SRT, virtual clock */
+    int    null_output;        /* --bench/--simulate: output to /dev/null */
+    EncoderProfile enc;
 } Config;
 
 /* Decoder context for a media source (background or SRT) */
@@ -55,9 +120,187 @@ typedef struct {
     int              video_stream_idx;
     int              audio_stream_idx;
     struct SwsContext *sws_ctx;
+    int              sws_flags;      /* flags sws_ctx was built with */
     SwrContext       *swr_ctx;
 } SourceCtx;
 
+/* Latency probe: the --probe-send sender paints wall-clock µs as a row of
+ * black and white blocks across the top of each picture. With
+ * latency_probe the compositor reads the row back and times the picture
+ * through the pipeline. Times are CLOCK_REALTIME µs, since sender and
+ * compositor run on one host. */
+#define PROBE_BITS    64         /* 8 sync bits + 56 bits of time */
+#define PROBE_SYNC    0xA5
+#define PROBE_PENDING 8          /* marks waiting for their encoded packet */
+
+typedef struct {
+    int64_t          sent_us;        /* painted by the sender, 0 = no mark */
+    int64_t          read_us;        /* SRT packet read */
+    int64_t          decoded_us;     /* decoded, scaled and published */
+    int64_t          encode_us;      /* handed to the video encoder */
+    int64_t          pts;            /* output video pts */
+} ProbeMark;
+
+/* How the FLV writer orders and flushes packets */
+enum MuxMode { MUX_INTERLEAVED, MUX_LOWLATENCY };
+
+/* Bounded packet queue between the encoders and a writer thread.
+ * Pushing never blocks: when full, queued and incoming video is dropped
+ * up to the next keyframe, and audio is kept as long as possible. */
+typedef struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    AVPacket       **pkts;          /* ring of cap entries */
+    int64_t         *enq_us;        /* push time of each entry */
+    int              cap, head, count;
+    int64_t          bytes, max_bytes, peak_bytes;
+    int              video_idx;     /* stream index the drop policy treats as video */
+    int              waiting_key;   /* dropping video until the next keyframe */
+    int              closed;
+    int64_t          dropped_video;
+    int64_t          dropped_audio;
+} PacketQueue;
+
+/* Local recording of the exact packets sent upstream, written by its own
+ * thread through a large write buffer */
+typedef struct {
+    AVFormatContext *fmt_ctx;
+    PacketQueue      queue;
+    pthread_t        thread;
+    int              running;
+    int              fd;
+    AVRational       src_tb[2];      /* live stream time bases, by stream index */
+    int              degraded;       /* dropping because the disk can't keep up */
+    atomic_int       failed;         /* write error; packets are discarded */
+    _Atomic int64_t  bytes_written;  /* written by the recorder thread, read by stats */
+} Recorder;
+
+/* Time packets spend between the encoder and the output pipe. The writer
+ * replays libavformat's interleaving rule (a packet leaves once every
+ * stream has one buffered) to see how long each was held back. */
+#define MUX_PENDING 256
+typedef struct {
+    struct { int64_t dts_us, enq_us; int stream; } pend[MUX_PENDING];  /* dts order */
+    int              count;
+    int              per_stream[2];
+    int64_t          sum_us, max_us, n;   /* current stats window, queue lock */
+    int64_t          busy_us;             /* writer time in the muxer, queue lock */
+} MuxLatency;
+
+/* ------------------------------------------------------------------ */
+/* Shared-memory packet ring (shm_ring_path), for co-located consumers. */
+/*                                                                      */
+/* One writer (the compositor), any number of readers that map the file */
+/* read-only and never signal back, so they can come and go freely.     */
+/* Records are ShmPktHeader + payload, 8-byte aligned, at positions     */
+/* that grow forever; the byte offset is pos % data_size. A record      */
+/* never wraps: a header with size == 0 and stream == SHM_PAD means     */
+/* "skip to the start of the data area".                                */
+/*                                                                      */
+/* Reader loop: start at last_key_pos; wait while pos == write_pos      */
+/* (sleep on the doorbell futex with waiters incremented); copy the     */
+/* record; atomic_thread_fence(memory_order_acquire); re-read           */
+/* write_pos. If write_pos - pos > data_size/2 the record may have been */
+/* overwritten while copying, so discard it and resync to last_key_pos. */
+/* The bound is data_size/2 because a publish in flight writes a pad    */
+/* plus a record (each under data_size/4) past write_pos before moving  */
+/* it. The fence keeps the copy's loads ahead of the re-read.           */
+/* Payloads are H.264 Annex B / raw AAC frames; codec setup is in the   */
+/* header. Requires lock-free 64-bit atomics (64-bit hosts).            */
+/*                                                                      */
+/* Each start builds the ring in a temporary file and renames it over   */
+/* the path, so a reader still mapped to the previous instance keeps    */
+/* that (closed) inode instead of faulting on a truncated one; re-open  */
+/* the path once closed is set.                                         */
+/* ------------------------------------------------------------------ */
+#define SHM_RING_MAGIC    0x31474e4952454552ULL   /* "REERING1" */
+#define SHM_RING_VERSION  1
+#define SHM_PKT_KEY       1
+#define SHM_PAD           0xffffffffu
+
+typedef struct {
+    uint64_t         magic;           /* written last, after the fields below */
+    uint32_t         version;
+    uint32_t         header_size;     /* offset of the data area in the file */
+    uint64_t         data_size;
+    int32_t          width, height;
+    int32_t          sample_rate, channels;
+    int32_t          tb_num[2], tb_den[2];      /* per stream: 0 video, 1 audio */
+    uint32_t         extradata_size[2];
+    uint8_t          extradata[2][512];
+    _Atomic uint64_t write_pos;       /* end of the newest complete record */
+    _Atomic uint64_t last_key_pos;    /* start of the newest video keyframe */
+    _Atomic uint64_t seq;             /* records published */
+    _Atomic uint32_t doorbell;        /* futex word, bumped on every publish */
+    _Atomic uint32_t waiters;         /* readers blocked on doorbell */
+    _Atomic uint32_t closed;          /* writer has exited */
+} ShmRingHeader;
+
+typedef struct {
+    uint32_t         size;            /* payload bytes following this header */
+    uint32_t         stream;          /* 0 video, 1 audio, SHM_PAD */
+    uint32_t         flags;           /* SHM_PKT_KEY */
+    uint32_t         reserved;
+    uint64_t         seq;
+    int64_t          pts, dts, duration;   /* in the stream's time base */
+} ShmPktHeader;
+
+/* Writer side of the ring */
+typedef struct {
+    ShmRingHeader   *hdr;
+    uint8_t         *data;
+    size_t           map_size;
+    int              active;
+} ShmRing;
+
+/* Growable FIFO of packets, main thread only */
+typedef struct {
+    AVPacket       **pkts;
+    int              cap, head, count;
+    int64_t          bytes;
+} PktFifo;
+
+/* Broadcast delay line: encoded packets held back before the FLV writer.
+ * Delay changes land on GOP boundaries: growing pauses the output until
+ * the buffer is deep enough, draining cuts whole GOPs and shifts later
+ * timestamps back so the output timeline stays continuous. */
+typedef struct {
+    PktFifo          fifo;
+    int64_t          delay_us;        /* delay being applied */
+    int64_t          target_us;       /* requested delay */
+    int64_t          offset_us;       /* subtracted from released timestamps */
+    int64_t          live_edge_us;    /* newest dts pushed */
+    int              active;          /* packets go through the line */
+} DelayLine;
+
+/* Instant-replay ring: the newest encoded packets, always starting on a
+ * keyframe and trimmed a whole GOP at a time. The byte budget wins over
+ * the time window. Clips are written by a background thread from
+ * references cloned out of the ring. */
+typedef struct {
+    PktFifo          fifo;
+    int64_t          span_us;         /* keep at least this much, 0 = off */
+    int64_t          max_bytes;
+    int              gops;            /* keyframes in fifo */
+    int64_t          next_gop_us;     /* dts of the second keyframe */
+    int64_t          newest_us;
+    pthread_t        thread;          /* clip writer */
+    int              joinable;
+    atomic_int       busy;
+    int64_t          clips;
+} ReplayRing;
+
+/* One clip export, owned by the writer thread */
+typedef struct {
+    AVPacket       **pkts;
+    int              count;
+    AVCodecParameters *par[2];        /* by stream index */
+    AVRational       tb[2];
+    int64_t          start_us;        /* dts of the first keyframe */
+    char             path[2048];
+    ReplayRing      *ring;
+} ReplayJob;
+
 /* Output encoder context */
 typedef struct {
     AVFormatContext *fmt_ctx;
@@ -67,19 +310,289 @@ typedef struct {
     AVStream        *audio_stream;
     int64_t          video_pts;
     int64_t          audio_pts;
+    int64_t          last_key_pts;     /* pts of the newest video keyframe */
+    int64_t          idr_request_pts;  /* pending IDR request, -1 = none */
+    int64_t          idr_min_frames;   /* rate limit for forced IDRs */
+    int64_t          forced_idrs;
+    int              rate_full;        /* SRT rate (ABR/CBR bitrate or VBV maxrate), 0 = fixed */
+    int              rate_cur;         /* rate the encoder is configured for */
+    int              rate_target;
+    int64_t          rate_next_step;   /* video pts of the next ramp step */
+    PacketQueue      queue;            /* encoded packets waiting for the muxer */
+    pthread_t        mux_thread;
+    int              mux_running;
+    MuxLatency       mux_lat;          /* writer thread */
+    AVPacket        *tick_pkts[64];    /* MUX_LOWLATENCY: this tick's packets */
+    int              tick_count;
+    Recorder         rec;
+    ShmRing          shm;
+    DelayLine        delay;
+    ReplayRing       replay;
+    int              new_extradata;    /* reopened encoder changed SPS/PPS */
+    int64_t          frames;           /* video frames sent to the encoder */
+    _Atomic int64_t  bytes_out[2];     /* encoded, by stream index (metrics) */
+    ProbeMark        probe_pend[PROBE_PENDING];
+    int              probe_next;
 } OutputCtx;
 
 /* Shared SRT frame buffer (SRT thread → main thread) */
 typedef struct {
     pthread_mutex_t  lock;
+    pthread_cond_t   cond;           /* --bench: picture published / taken */
     uint8_t         *video_data[4];
     int              video_linesize[4];
     int              has_video;
+    uint64_t         video_seq;      /* bumped for every new picture */
+    uint64_t         taken_seq;      /* newest picture main_loop copied */
     AVAudioFifo     *audio_fifo;
     int64_t          last_frame_time;
+    ProbeMark        probe;          /* latency_probe: mark of the newest picture */
     int              connected;
+    /* Counters below are atomic so the metrics thread can read them
+     * without the lock; writers still hold it */
+    _Atomic int64_t  connects;
+    _Atomic int64_t  video_received; /* video packets read */
+    _Atomic int64_t  video_decoded;  /* pictures decoded */
+    _Atomic int64_t  video_dropped;  /* pictures replaced before main_loop took them */
+    atomic_int       tid;            /* SRT thread id for perf_counters, 0 = not started */
+    int64_t          cpu_ns;         /* SRT thread CPU time, set when it exits */
 } SrtShared;
 
+/* Cumulative main loop counters (reported by the stats event and read
+ * by the metrics thread) */
+typedef struct {
+    _Atomic int64_t dup_srt;     /* ticks repeated because SRT had no new picture */
+    _Atomic int64_t dup_bg;      /* ticks repeated because background had no new picture */
+    _Atomic int64_t dup_late;    /* repeats emitted by LATE_DUPLICATE */
+    _Atomic int64_t dup_gov;     /* repeats from the governor's half-rate level */
+    _Atomic int64_t pad_samples; /* audio samples the encoder got as silence */
+} LoopStats;
+
+/* main_loop stages timed every tick */
+enum Stage { ST_BG_DECODE, ST_SRT_COPY, ST_VIDEO_ENC, ST_AUDIO_ENC, ST_OUTPUT, ST_COUNT };
+
+/* Per-window tick measurements for the stats event */
+#define TICK_SAMPLES 256
+typedef struct {
+    int64_t     start_us;        /* window start */
+    int64_t     frames;          /* OutputCtx.frames at window start */
+    int64_t     stage_us[ST_COUNT];
+    int64_t     tick_us[TICK_SAMPLES];   /* busy time of each tick */
+    int         ticks;
+} TickStats;
+
+/* --bench run totals. In bench mode every SRT picture is composited
+ * exactly once: the SRT thread waits until main_loop took the previous
+ * picture and main_loop waits for the next one instead of pacing. */
+typedef struct {
+    int64_t     start_us, end_us;
+    int64_t     ticks;
+    int64_t     stage_us[ST_COUNT];
+    int64_t     main_cpu_ns;     /* main thread, at the end of the run */
+    struct rusage usage;         /* whole process, at the end of the run */
+} BenchStats;
+
+/* perf_counters: user-space hardware counters of one thread, read as
+ * deltas per stats line. Context switches come from /proc, which needs
+ * no permission and splits voluntary from involuntary (preempted). */
+enum PerfCounter { PC_CYCLES, PC_INSTRUCTIONS, PC_LLC_MISSES, PC_COUNT };
+
+typedef struct {
+    pid_t       tid;             /* 0 = not attached yet */
+    int         fd[PC_COUNT];    /* -1 = not supported or not permitted */
+    double      last[PC_COUNT];  /* scaled counts at the previous stats line */
+    long        last_ctx[2];     /* voluntary, involuntary */
+} ThreadCounters;
+
+typedef struct {
+    ThreadCounters main;
+    ThreadCounters srt;
+} PerfCounters;
+
+/* --simulate: a scenario script stands in for the SRT sender and the
+ * main loop runs on a virtual clock, one frame duration per tick */
+enum SimCmd { SIM_CONNECT, SIM_DROP, SIM_CLOSE, SIM_LOSS, SIM_END };
+#define SIM_EVENTS      64
+#define SIM_AUDIO_CHUNK 1024     /* samples per sender audio packet */
+
+typedef struct {
+    int64_t     at_us;          /* virtual time */
+    enum SimCmd cmd;
+    double      loss;           /* fraction of packets lost from here on */
+} SimEvent;
+
+/* What followed one event, measured until the next one. The _us fields
+ * are relative to the event, -1 = did not happen. */
+typedef struct {
+    int64_t     detect_us;      /* SrtShared.connected changed */
+    int64_t     video_us;       /* output picture changed source */
+    int64_t     audio_us;       /* audio reached AUDIO_SRT or AUDIO_BG */
+    int64_t     frozen_ticks;   /* ticks repeating an SRT picture */
+    int64_t     pad_samples;    /* audio samples encoded as silence */
+    double      av_min_ms, av_max_ms;   /* output audio minus video timeline */
+} SimResult;
+
+typedef struct {
+    SimEvent    ev[SIM_EVENTS];
+    SimResult   res[SIM_EVENTS];
+    int         count, next;    /* events parsed / next to apply */
+    int64_t     tick;
+    int         open;           /* connection up as the SRT thread sees it */
+    int         sending;        /* sender still streaming */
+    double      loss;
+    uint64_t    rng;
+    int64_t     origin_us;      /* sender clock start (last connect) */
+    int64_t     video_sent, audio_sent;   /* pictures / samples since then */
+    uint8_t    *pic[4];         /* sender picture */
+    int         linesize[4];
+    uint8_t    *tone[2];        /* sender audio packet, SIM_AUDIO_CHUNK samples */
+    int         last_connected, last_video, last_audio;
+    int64_t     last_pad;
+    int64_t     start_us, end_us;   /* wall clock */
+} SimState;
+
+/* Overload governor levels, each including the ones before it */
+enum GovLevel {
+    GOV_NORMAL,
+    GOV_FAST_SCALE,      /* SWS_FAST_BILINEAR for source scaling */
+    GOV_SKIP_BG,         /* no background decode while SRT is on screen */
+    GOV_FAST_ENC,        /* encoder reopened with header-neutral speed options */
+    GOV_HALF_RATE,       /* every other tick repeats the previous picture */
+    GOV_LEVELS
+};
+
+/* Watches main_loop busy time per one-second window. Sustained load
+ * steps the level down quickly; recovery steps it back up slowly. */
+typedef struct {
+    int         level;           /* enum GovLevel */
+    int         max_level;
+    int64_t     busy_us, ticks;  /* current window */
+    int64_t     stage_us[ST_COUNT];
+    int64_t     missed_seen;     /* FrameClock.missed_ticks at window start */
+    int         over, under;     /* consecutive overloaded / idle windows */
+    double      load;            /* busy fraction of the last window */
+} Governor;
+
+/* Latency histogram in µs: per-bucket counts (not cumulative), the last
+ * bucket is +Inf */
+#define METRIC_BUCKETS 12
+typedef struct {
+    _Atomic uint64_t bucket[METRIC_BUCKETS];
+    _Atomic uint64_t sum_us;
+} MetricHist;
+
+/* Prometheus endpoint (metrics_socket). Recording is relaxed atomic adds
+ * and stores from the threads that own the data; gauges guarded by locks
+ * elsewhere are refreshed with each stats event. A scraper thread formats
+ * the text exposition on its own, so a scrape never waits on main_loop
+ * and main_loop never waits on a scrape. */
+typedef struct {
+    int              fd;             /* listening socket, -1 = off */
+    pthread_t        thread;
+    atomic_int       stop;
+    _Atomic int64_t  ticks, late_ticks, missed_ticks, resyncs;
+    MetricHist       tick_us;        /* busy time per tick */
+    MetricHist       stage_us[ST_COUNT];
+    _Atomic int64_t  srt_bytes;      /* SRT input read, all streams */
+    /* Refreshed by emit_stats() */
+    atomic_int       srt_connected;
+    _Atomic int64_t  out_queue_pkts, out_queue_bytes;
+    _Atomic int64_t  out_dropped[2]; /* writer queue drops: video, audio */
+    _Atomic int64_t  audio_fifo[3];  /* samples: SRT shared, SRT local, bg */
+    _Atomic int64_t  delay_bytes, replay_bytes;
+    atomic_int       governor_level;
+} Metrics;
+
+/* Dashboard thumbnail tap: main_loop hands a reference to out_frame to a
+ * low-priority thread, which scales it, encodes a JPEG and renames it
+ * over thumb_path */
+typedef struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    AVFrame         *pending;        /* being encoded, NULL = idle */
+    int              stop;
+    pthread_t        thread;
+    int              running;
+    int64_t          next_pts;       /* video pts of the next capture */
+    int64_t          written;
+    AVCodecContext  *enc;            /* MJPEG */
+    struct SwsContext *sws;
+    AVFrame         *small;
+    AVPacket        *pkt;
+} ThumbTap;
+
+/* Asynchronous stderr log: a bounded lock-free ring of formatted lines
+ * (per-slot sequence numbers, any thread may produce) drained by one
+ * logger thread. Producers never block; a full ring drops and counts. */
+#define LOG_SLOTS  128
+#define LOG_LINE   4096
+
+typedef struct {
+    _Atomic uint64_t seq;            /* == pos: free, == pos + 1: filled */
+    int              len;            /* 0 = dropped (did not fit) */
+    char             line[LOG_LINE];
+} LogSlot;
+
+typedef struct {
+    LogSlot         *slots;
+    _Atomic uint64_t head;           /* next position to claim */
+    uint64_t         tail;           /* next position to write, logger only */
+    _Atomic uint32_t doorbell;       /* futex word, bumped on every publish */
+    _Atomic uint32_t waiting;        /* logger is asleep on doorbell */
+    atomic_int       running;
+    atomic_int       stop;
+    _Atomic uint64_t dropped;
+    pthread_t        thread;
+} LogRing;
+
+/* Held copy of a coalesced event (logger thread only) */
+typedef struct {
+    int64_t          last_us;        /* when this event was last written */
+    uint64_t         order;          /* arrival order of the held line */
+    int              count;          /* occurrences folded into line */
+    int              len;
+    char             line[LOG_LINE];
+} LogHeld;
+
+/* Span tracing (built with make TRACE=1, enabled by trace_path). Each
+ * thread that calls TRACE_THREAD() owns a ring of completed spans; the
+ * owner only stores the event and bumps head. A dump thread copies the
+ * rings on SIGUSR1 and at exit and writes Chrome trace JSON, discarding
+ * any entry the owner may have overwritten while it was being copied. */
+#define TRACE_EVENTS  65536          /* per thread, power of two */
+#define TRACE_THREADS 16
+
+typedef struct {
+    const char      *name;           /* string literal */
+    int64_t          start_ns, dur_ns;
+} TraceEvent;
+
+typedef struct {
+    TraceEvent      *ev;
+    _Atomic uint64_t head;           /* events ever recorded */
+    pid_t            tid;
+    const char      *name;
+} TraceBuf;
+
+typedef struct {
+    TraceBuf        *bufs[TRACE_THREADS];
+    atomic_int       count;
+    atomic_int       dump;           /* set by SIGUSR1 */
+    atomic_int       stop;
+    pthread_t        thread;
+    int              running;
+} TraceState;
+
+#ifdef SRT_TRACE
+#define TRACE_THREAD(name)   trace_thread(name)
+#define TRACE_BEGIN(v)       int64_t v = trace_begin()
+#define TRACE_END(v, name)   trace_end(v, name)
+#else
+#define TRACE_THREAD(name)   ((void)0)
+#define TRACE_BEGIN(v)       ((void)0)
+#define TRACE_END(v, name)   ((void)0)
+#endif
+
 /* Top-level application state */
 typedef struct {
     SourceCtx   bg;
@@ -90,56 +603,268 @@ typedef struct {
     AVFrame    *out_frame;
     AVAudioFifo *bg_audio_fifo;
     AVAudioFifo *srt_local_fifo;
+    int         bg_still;        /* single-picture background: decode once */
+    int         ctl_fd;          /* control socket, -1 = none */
+    ThumbTap    thumb;
+    Governor    gov;
+    atomic_int  sws_flags;       /* source scaler flags, set by the governor */
+    LoopStats   stats;
+    Metrics     metrics;
+    BenchStats  bench;
+    PerfCounters perf;           /* perf_counters */
+    SimState   *sim;             /* --simulate, NULL otherwise */
 } AppState;
 
+/* Which source the picture in out_frame came from */
+enum VideoSrc { SRC_NONE, SRC_SRT, SRC_BG };
+
 /* Audio source state machine */
 enum AudioMode { AUDIO_SRT, AUDIO_GRACE, AUDIO_BG };
 
+/* What the frame clock does with deadlines that already passed */
+enum LatePolicy { LATE_CATCHUP, LATE_SKIP, LATE_DUPLICATE };
+
+/* Tick lateness histogram: 9 bounded buckets + overflow */
+#define JITTER_BUCKETS 10
+
+/* Absolute-deadline frame clock on CLOCK_MONOTONIC.
+ * Deadline n is epoch + n * den/num seconds, so there is no rounding drift. */
+typedef struct {
+    int64_t     epoch_ns;
+    AVRational  rate;           /* frames per second */
+    int64_t     tick;           /* index of the next deadline */
+    int64_t     late_ticks;     /* wake-ups a whole frame slot or more past the deadline */
+    int64_t     missed_ticks;   /* whole frame slots lost to lateness */
+    int64_t     resyncs;        /* epoch re-anchored after a stall */
+    int64_t     jitter_hist[JITTER_BUCKETS];
+} FrameClock;
+
 /* ================================================================== */
 /*  Globals                                                            */
 /* ================================================================== */
 
 extern Config g_cfg;
 extern volatile int g_running;
+extern int64_t g_sim_now_us;     /* --simulate virtual clock, -1 = real time */
 
 /* ================================================================== */
 /*  Forward declarations                                               */
 /* ================================================================== */
 
 /* Config */
+static void   config_defaults(void);
 static int    load_config(const char *path);
 static int    json_get_int(const char *json, const char *key, int def);
 static double json_get_double(const char *json, const char *key, double def);
 static void   json_get_str(const char *json, const char *key,
                             char *buf, size_t size, const char *def);
+static int    json_get_bool(const char *json, const char *key, int def);
+static char  *json_get_object(const char *json, const char *key);
+
+/* Encoder profiles */
+static void   encoder_profile_defaults(EncoderProfile *p);
+static int    name_in_list(const char *name, const char *const *list);
+static void   parse_encoder_profile(const char *obj, EncoderProfile *p);
+static int    validate_encoder_profile(const EncoderProfile *p, char *err, size_t size);
+static void   apply_encoder_profile(AVCodecContext *c, const EncoderProfile *p);
 
 /* Logging */
 static void   jlog(const char *event, const char *extra);
+static int    log_format(char *buf, size_t size, const char *event, const char *extra);
+static int    log_start(void);
+static void   log_shutdown(void);
+static void  *log_thread_func(void *arg);
+static int    log_drain(void);
+static void   log_emit(const char *line, int len);
+static void   log_flush_held(void);
+static void   log_write(const char *buf, size_t len);
 
 /* Signal */
 static void   signal_handler(int sig);
 
+#ifdef SRT_TRACE
+/* Tracing */
+static int    trace_start(void);
+static void   trace_stop(void);
+static void   trace_thread(const char *name);
+static int64_t trace_begin(void);
+static void   trace_end(int64_t start_ns, const char *name);
+static void   trace_signal(int sig);
+static void  *trace_thread_func(void *arg);
+static int    trace_dump(void);
+#endif
+
 /* Source management */
 static void   close_source(SourceCtx *src);
 static int    open_decoder(AVFormatContext *fmt, int idx, AVCodecContext **ctx);
 static int    find_stream(AVFormatContext *fmt, enum AVMediaType type);
 static SwrContext *make_resampler(AVCodecContext *dec);
+static int    source_scaler(SourceCtx *s, int flags);
 static int    open_background(AppState *app);
 
 /* SRT */
 static int    srt_interrupt_cb(void *opaque);
 static int    open_srt_source(SourceCtx *s, const char *url);
 static void  *srt_thread_func(void *arg);
+static void   srt_set_connected(SrtShared *sh);
+static void   srt_set_dropped(SrtShared *sh, const char *reason);
+static int    srt_timed_out(SrtShared *sh);
+static void   srt_publish_video(SrtShared *sh, uint8_t *const data[4], const int linesize[4],
+                                int64_t sent_us, int64_t read_us, int bench);
+static void   srt_publish_audio(SrtShared *sh, uint8_t **buf, int samples);
 
 /* Output */
 static int    open_output(AppState *app);
+static AVCodecContext *open_video_encoder(OutputCtx *o, const char *x264_params);
+static void   close_output(OutputCtx *o);
+static void  *mux_thread_func(void *arg);
+static void   output_packet(OutputCtx *o, AVPacket *pkt);
+static void   live_packet(OutputCtx *o, AVPacket *q);
+static void   output_flush_tick(OutputCtx *o);
+static void   mux_lat_add(OutputCtx *o, const AVPacket *pkt, int64_t enq_us);
+static void   mux_lat_release(OutputCtx *o, int all);
+
+/* Per-source rate control */
+static void   rate_init(OutputCtx *o);
+static void   rate_apply(OutputCtx *o, int rate);
+static void   rate_update(OutputCtx *o, int srt_on_screen);
+
+/* Recording */
+static int    open_recorder(OutputCtx *o);
+static void   close_recorder(Recorder *r);
+static void  *recorder_thread_func(void *arg);
+static int    recorder_write_cb(void *opaque, uint8_t *buf, int size);
+static void   recorder_poll(Recorder *r);
+
+/* Shared-memory ring */
+static int    shm_ring_open(OutputCtx *o);
+static void   shm_ring_publish(ShmRing *r, const AVPacket *pkt);
+static void   shm_ring_close(ShmRing *r);
+
+/* Packet FIFO */
+static int    fifo_push(PktFifo *f, AVPacket *pkt);
+static AVPacket *fifo_peek(const PktFifo *f, int i);
+static AVPacket *fifo_pop(PktFifo *f);
+static void   fifo_free(PktFifo *f);
+
+/* Broadcast delay */
+static int64_t pkt_dts_us(const OutputCtx *o, const AVPacket *pkt);
+static void   delay_set(OutputCtx *o, double seconds);
+static void   delay_push(OutputCtx *o, AVPacket *pkt);
+static int    delay_next_video(const OutputCtx *o, int from);
+static int    delay_at_gop(const OutputCtx *o);
+static void   delay_drain(OutputCtx *o);
+static void   delay_release(OutputCtx *o);
+
+/* Instant replay */
+static void   replay_push(OutputCtx *o, const AVPacket *pkt);
+static void   replay_drop_gop(OutputCtx *o);
+static int    replay_clip(OutputCtx *o, double seconds, const char *path,
+                          char *reply, size_t size);
+static void  *replay_thread_func(void *arg);
+static void   replay_job_free(ReplayJob *job);
+static void   replay_close(ReplayRing *r);
+
+/* Thumbnail tap */
+static int    thumb_open(ThumbTap *t);
+static void   thumb_capture(ThumbTap *t, const AVFrame *frame, int64_t video_pts);
+static void  *thumb_thread_func(void *arg);
+static int    thumb_write(ThumbTap *t);
+static void   thumb_close(ThumbTap *t);
+
+/* Control socket */
+static int    control_open(AppState *app);
+static void   control_poll(AppState *app);
+static void   control_exec(AppState *app, const char *cmd, char *reply, size_t size);
+static void   control_close(AppState *app);
+
+/* Packet queue */
+static int    pq_init(PacketQueue *q, int cap, int64_t max_bytes, int video_idx);
+static void   pq_free(PacketQueue *q);
+static int    pq_push(PacketQueue *q, AVPacket *pkt);
+static AVPacket *pq_pop(PacketQueue *q, int64_t *enq_us);
+static void   pq_close(PacketQueue *q);
+static void   pq_drop_video(PacketQueue *q);
 
 /* Encoding */
+static void   request_idr(OutputCtx *o);
 static int    encode_write_video(OutputCtx *o, AVFrame *frame);
+static void   video_receive(OutputCtx *o);
+static int    encoder_reopen(OutputCtx *o, const char *x264_params);
 static int    read_bg_frame(SourceCtx *s, AVFrame *scaled, AVAudioFifo *afifo);
 static void   loop_bg(SourceCtx *s);
 static void   encode_one_audio_frame(AppState *app, AVAudioFifo *fifo, int aframe_sz);
 
+/* Frame clock */
+static int64_t clock_us(void);
+static AVRational fps_to_rational(double fps);
+static int64_t mono_ns(void);
+static void   fclock_init(FrameClock *c, AVRational rate);
+static int64_t fclock_deadline_ns(const FrameClock *c, int64_t tick);
+static int    fclock_wait(FrameClock *c);
+static int    fclock_hist_json(const FrameClock *c, char *buf, size_t size);
+
+/* Overload governor */
+static void   governor_account(Governor *g, const int64_t stage_us[ST_COUNT], int64_t busy_us);
+static void   governor_update(AppState *app, const FrameClock *clk);
+static void   governor_set_level(AppState *app, int level);
+static const char *governor_level_name(int level);
+static const char *governor_x264_params(const char *preset);
+
+/* Stats */
+static void   tick_stats_add(TickStats *ts, const int64_t stage_us[ST_COUNT], int64_t busy_us);
+static int    cmp_int64(const void *a, const void *b);
+static void   emit_stats(AppState *app, FrameClock *clk, TickStats *ts, enum AudioMode audio_mode);
+
+/* Metrics endpoint */
+static int    metrics_open(AppState *app);
+static void   metric_observe(MetricHist *h, int64_t us);
+static void   metrics_tick(Metrics *m, const FrameClock *clk,
+                           const int64_t stage_us[ST_COUNT], int64_t busy_us);
+static void  *metrics_thread_func(void *arg);
+static void   metrics_serve(AppState *app, int fd);
+static int    metrics_format(AppState *app, char *buf, size_t size);
+static void   metrics_printf(char *buf, size_t size, int *n, const char *fmt, ...);
+static void   metrics_hist(char *buf, size_t size, int *n, const char *name,
+                           const char *label, const MetricHist *h);
+static int64_t rss_bytes(void);
+static void   metrics_close(Metrics *m);
+
+/* Latency probe */
+static void   probe_paint(uint8_t *y, int linesize, int width, int64_t us);
+static int64_t probe_read(const uint8_t *y, int linesize, int width);
+static void   probe_encode(OutputCtx *o, ProbeMark *m);
+static void   probe_attach(OutputCtx *o, AVPacket *pkt);
+static void   probe_report(const ProbeMark *m, int64_t write_us);
+static int    probe_write(AVFormatContext *oc, AVCodecContext *c, AVStream *st,
+                          AVFrame *frame, AVPacket *pkt);
+static int    probe_send(const char *url);
+
+/* Benchmark */
+static int64_t thread_cpu_ns(void);
+static void   bench_finish(AppState *app);
+static void   bench_report(AppState *app);
+
+/* Hardware counters */
+static int    perf_open(pid_t tid, enum PerfCounter c);
+static int    perf_read(int fd, double *value);
+static int    perf_ctx_switches(pid_t tid, long ctx[2]);
+static void   perf_attach(ThreadCounters *t, pid_t tid, const char *thread);
+static int    perf_thread_json(ThreadCounters *t, const char *thread, char *buf, size_t size);
+static int    perf_stats_json(AppState *app, char *buf, size_t size);
+static void   perf_close(PerfCounters *p);
+
+/* Simulation */
+static int    sim_load(SimState *s, const char *path);
+static void   sim_paint(SimState *s, int64_t n);
+static int    sim_lost(SimState *s);
+static void   sim_apply(AppState *app, const SimEvent *e);
+static int    sim_step(AppState *app);
+static void   sim_observe(AppState *app, int srt_video, int srt_new, enum AudioMode audio_mode);
+static void   sim_report(AppState *app);
+static const char *sim_ms(char *buf, size_t size, int64_t us);
+static void   sim_free(SimState *s);
+
 /* Main loop */
 static void   main_loop(AppState *app);
 
@@ -0,0 +1,391 @@
+/*
+ * udp_impair - UDP relay that injects loss, reordering, delay and jitter
+ *
+ * Sits between an SRT caller and srt_compositor's listener on loopback,
+ * so soak tests can impair the link without root or netem:
+ *
+ *   sender ──► :listen  udp_impair  ──► target (compositor listener)
+ *          ◄──                      ◄──
+ *
+ * Both directions are impaired, so SRT's ACKs and NAKs suffer too. A new
+ * sender address (the caller restarted) gets a fresh upstream socket and
+ * the listener sees a new peer, as it would after a real reconnect.
+ *
+ * Every --stats seconds a JSON line with per-direction counters goes to
+ * stderr, in the compositor's event format.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PKT    2048          /* SRT payloads are at most 1500 bytes */
+#define QUEUE_CAP  16384         /* packets in flight across both directions */
+
+enum Dir { DIR_FWD, DIR_REV, DIR_COUNT };
+
+typedef struct {
+    double  loss;                /* fraction dropped */
+    double  reorder;             /* fraction held back by reorder_us */
+    int64_t reorder_us;
+    int64_t delay_us;            /* fixed one-way delay */
+    int64_t jitter_us;           /* uniform extra delay 0..jitter_us */
+    int64_t burst_every_us;      /* 0 = no bursts */
+    int64_t burst_len_us;
+    double  burst_loss;          /* loss fraction inside a burst */
+    int64_t burst_jitter_us;     /* extra jitter inside a burst */
+    int     stats_s;
+    uint64_t seed;
+} ImpairCfg;
+
+/* A packet waiting for its release time */
+typedef struct {
+    int64_t  due_us;
+    uint64_t order;              /* arrival order, breaks due_us ties */
+    int      dir;
+    int      len;
+    uint8_t  data[MAX_PKT];
+} Held;
+
+typedef struct {
+    int64_t in, out, lost, reordered, overflow;
+} DirStats;
+
+typedef struct {
+    ImpairCfg  cfg;
+    int        listen_fd;        /* sender side */
+    int        up_fd;            /* target side, one per sender address */
+    struct sockaddr_storage target, client;
+    socklen_t  target_len, client_len;
+    int        have_client;
+    Held     **heap;             /* min-heap on (due_us, order) */
+    int        count;
+    uint64_t   order;
+    uint64_t   rng;
+    int64_t    start_us;
+    int64_t    bursts;
+    DirStats   st[DIR_COUNT];
+} Relay;
+
+static volatile int g_running = 1;
+static void signal_handler(int sig) { (void)sig; g_running = 0; }
+
+/* ================================================================== */
+/*  Helpers                                                            */
+/* ================================================================== */
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64: a seed reproduces the same impairment pattern */
+static double rnd(Relay *r) {
+    r->rng ^= r->rng << 13;
+    r->rng ^= r->rng >> 7;
+    r->rng ^= r->rng << 17;
+    return (r->rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int resolve(const char *hostport, struct sockaddr_storage *ss, socklen_t *len) {
+    char host[256];
+    const char *colon = strrchr(hostport, ':');
+    if (!colon || colon == hostport || (size_t)(colon - hostport) >= sizeof(host))
+        return -1;
+    memcpy(host, hostport, colon - hostport);
+    host[colon - hostport] = '\0';
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+    memcpy(ss, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* ================================================================== */
+/*  Release queue                                                      */
+/* ================================================================== */
+
+static int held_before(const Held *a, const Held *b) {
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static void heap_push(Relay *r, Held *h) {
+    int i = r->count++;
+    r->heap[i] = h;
+    while (i > 0 && held_before(r->heap[i], r->heap[(i - 1) / 2])) {
+        Held *t = r->heap[i];
+        r->heap[i] = r->heap[(i - 1) / 2];
+        r->heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+static Held *heap_pop(Relay *r) {
+    Held *top = r->heap[0];
+    r->heap[0] = r->heap[--r->count];
+    int i = 0;
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < r->count && held_before(r->heap[l], r->heap[m])) m = l;
+        if (l + 1 < r->count && held_before(r->heap[l + 1], r->heap[m])) m = l + 1;
+        if (m == i) break;
+        Held *t = r->heap[i];
+        r->heap[i] = r->heap[m];
+        r->heap[m] = t;
+        i = m;
+    }
+    return top;
+}
+
+/* ================================================================== */
+/*  Relay                                                              */
+/* ================================================================== */
+
+static int in_burst(Relay *r, int64_t now) {
+    const ImpairCfg *c = &r->cfg;
+    if (!c->burst_every_us) return 0;
+    int64_t t = now - r->start_us;
+    int64_t n = t / c->burst_every_us;
+    if (n == 0) return 0;        /* first burst one period after start */
+    if (t - n * c->burst_every_us >= c->burst_len_us) return 0;
+    if (n > r->bursts) {
+        r->bursts = n;
+        fprintf(stderr, "{\"event\":\"impair_burst\",\"ts\":%lld,\"n\":%lld,\"len_ms\":%lld}\n",
+                (long long)time(NULL), (long long)n, (long long)(c->burst_len_us / 1000));
+    }
+    return 1;
+}
+
+/* Decide the packet's fate and queue it for release */
+static void relay_admit(Relay *r, int dir, const uint8_t *data, int len, int64_t now) {
+    const ImpairCfg *c = &r->cfg;
+    DirStats *st = &r->st[dir];
+    st->in++;
+    int burst = in_burst(r, now);
+    double loss = burst ? c->burst_loss : c->loss;
+    if (loss > 0 && rnd(r) < loss) {
+        st->lost++;
+        return;
+    }
+    if (r->count == QUEUE_CAP) {
+        st->overflow++;
+        return;
+    }
+    int64_t jitter = c->jitter_us + (burst ? c->burst_jitter_us : 0);
+    int64_t due = now + c->delay_us + (jitter ? (int64_t)(rnd(r) * jitter) : 0);
+    if (c->reorder > 0 && rnd(r) < c->reorder) {
+        due += c->reorder_us;
+        st->reordered++;
+    }
+    Held *h = malloc(sizeof(*h));
+    if (!h) {
+        st->overflow++;
+        return;
+    }
+    h->due_us = due;
+    h->order  = r->order++;
+    h->dir    = dir;
+    h->len    = len;
+    memcpy(h->data, data, len);
+    heap_push(r, h);
+}
+
+static void relay_release(Relay *r, int64_t now) {
+    while (r->count && r->heap[0]->due_us <= now) {
+        Held *h = heap_pop(r);
+        ssize_t sent;
+        if (h->dir == DIR_FWD)
+            sent = send(r->up_fd, h->data, h->len, 0);
+        else
+            sent = r->have_client ?
+                sendto(r->listen_fd, h->data, h->len, 0,
+                       (struct sockaddr *)&r->client, r->client_len) : -1;
+        if (sent == h->len) r->st[h->dir].out++;
+        free(h);
+    }
+}
+
+/* Upstream socket connected to the target, so replies can be told apart */
+static int relay_upstream(Relay *r) {
+    if (r->up_fd >= 0) close(r->up_fd);
+    r->up_fd = socket(r->target.ss_family, SOCK_DGRAM, 0);
+    if (r->up_fd < 0) return -1;
+    if (connect(r->up_fd, (struct sockaddr *)&r->target, r->target_len) < 0) {
+        close(r->up_fd);
+        r->up_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void relay_stats(Relay *r) {
+    fprintf(stderr, "{\"event\":\"impair_stats\",\"ts\":%lld,\"queued\":%d,\"bursts\":%lld",
+            (long long)time(NULL), r->count, (long long)r->bursts);
+    static const char *const names[DIR_COUNT] = { "fwd", "rev" };
+    for (int d = 0; d < DIR_COUNT; d++) {
+        DirStats *s = &r->st[d];
+        fprintf(stderr, ",\"%s\":{\"in\":%lld,\"out\":%lld,\"lost\":%lld,\"reordered\":%lld,"
+                "\"overflow\":%lld}", names[d], (long long)s->in, (long long)s->out,
+                (long long)s->lost, (long long)s->reordered, (long long)s->overflow);
+    }
+    fprintf(stderr, "}\n");
+}
+
+static int relay_run(Relay *r) {
+    uint8_t buf[MAX_PKT];
+    int64_t next_stats = r->start_us + (int64_t)r->cfg.stats_s * 1000000;
+
+    while (g_running) {
+        int64_t now = now_us();
+        relay_release(r, now);
+        if (r->cfg.stats_s > 0 && now >= next_stats) {
+            relay_stats(r);
+            next_stats += (int64_t)r->cfg.stats_s * 1000000;
+        }
+
+        int timeout_ms = 100;
+        if (r->count) {
+            int64_t wait = r->heap[0]->due_us - now;
+            timeout_ms = wait <= 0 ? 0 : wait < 1000 ? 1 : (int)(wait / 1000);
+            if (timeout_ms > 100) timeout_ms = 100;
+        }
+        struct pollfd fds[2] = {
+            { .fd = r->listen_fd, .events = POLLIN },
+            { .fd = r->up_fd,     .events = POLLIN },
+        };
+        int nfds = r->up_fd >= 0 ? 2 : 1;
+        if (poll(fds, nfds, timeout_ms) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        now = now_us();
+
+        /* Non-blocking reads, and fds[1] is skipped once a new sender
+         * replaced up_fd: its readiness was for the closed socket (whose
+         * number the new one likely reuses) */
+        int up_replaced = 0;
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_storage from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(r->listen_fd, buf, sizeof(buf), MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &from_len);
+            if (n > 0) {
+                if (!r->have_client || from_len != r->client_len ||
+                    memcmp(&from, &r->client, from_len) != 0) {
+                    if (relay_upstream(r) < 0) return -1;
+                    up_replaced = 1;
+                    r->client = from;
+                    r->client_len = from_len;
+                    r->have_client = 1;
+                    fprintf(stderr, "{\"event\":\"impair_client\",\"ts\":%lld}\n",
+                            (long long)time(NULL));
+                }
+                relay_admit(r, DIR_FWD, buf, (int)n, now);
+            }
+        }
+        if (nfds == 2 && !up_replaced && (fds[1].revents & POLLIN)) {
+            ssize_t n = recv(r->up_fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0)
+                relay_admit(r, DIR_REV, buf, (int)n, now);
+        }
+    }
+    return 0;
+}
+
+/* ================================================================== */
+/*  main                                                               */
+/* ================================================================== */
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s --listen <port> --target <host:port> [options]\n"
+        "  --loss PCT            packets dropped, each direction (0)\n"
+        "  --reorder PCT         packets held back so later ones overtake (0)\n"
+        "  --reorder-ms MS       hold-back for reordered packets (10)\n"
+        "  --delay MS            one-way delay (0)\n"
+        "  --jitter MS           uniform extra delay 0..MS (0)\n"
+        "  --burst-every S       start a burst every S seconds (0 = off)\n"
+        "  --burst-len MS        burst length (1000)\n"
+        "  --burst-loss PCT      loss inside a burst (100)\n"
+        "  --burst-jitter MS     extra jitter inside a burst (0)\n"
+        "  --seed N              impairment pattern seed (1)\n"
+        "  --stats S             counters on stderr every S seconds (10, 0 = off)\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    Relay r;
+    memset(&r, 0, sizeof(r));
+    r.up_fd = -1;
+    r.cfg.reorder_us   = 10000;
+    r.cfg.burst_len_us = 1000000;
+    r.cfg.burst_loss   = 1.0;
+    r.cfg.stats_s      = 10;
+    r.cfg.seed         = 1;
+    int port = 0;
+    const char *target = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i], *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!v) { usage(argv[0]); return 1; }
+        i++;
+        if      (!strcmp(a, "--listen"))       port = atoi(v);
+        else if (!strcmp(a, "--target"))       target = v;
+        else if (!strcmp(a, "--loss"))         r.cfg.loss = atof(v) / 100;
+        else if (!strcmp(a, "--reorder"))      r.cfg.reorder = atof(v) / 100;
+        else if (!strcmp(a, "--reorder-ms"))   r.cfg.reorder_us = (int64_t)(atof(v) * 1000);
+        else if (!strcmp(a, "--delay"))        r.cfg.delay_us = (int64_t)(atof(v) * 1000);
+        else if (!strcmp(a, "--jitter"))       r.cfg.jitter_us = (int64_t)(atof(v) * 1000);
+        else if (!strcmp(a, "--burst-every"))  r.cfg.burst_every_us = (int64_t)(atof(v) * 1e6);
+        else if (!strcmp(a, "--burst-len"))    r.cfg.burst_len_us = (int64_t)(atof(v) * 1000);
+        else if (!strcmp(a, "--burst-loss"))   r.cfg.burst_loss = atof(v) / 100;
+        else if (!strcmp(a, "--burst-jitter")) r.cfg.burst_jitter_us = (int64_t)(atof(v) * 1000);
+        else if (!strcmp(a, "--seed"))         r.cfg.seed = strtoull(v, NULL, 10);
+        else if (!strcmp(a, "--stats"))        r.cfg.stats_s = atoi(v);
+        else { usage(argv[0]); return 1; }
+    }
+    if (port <= 0 || !target) { usage(argv[0]); return 1; }
+    if (resolve(target, &r.target, &r.target_len) < 0) {
+        fprintf(stderr, "Cannot resolve %s\n", target);
+        return 1;
+    }
+
+    r.listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (r.listen_fd < 0 || bind(r.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    r.heap = calloc(QUEUE_CAP, sizeof(*r.heap));
+    if (!r.heap) return 1;
+    r.rng = r.cfg.seed ? r.cfg.seed : 1;
+    r.start_us = now_us();
+
+    /* No SA_RESTART: a signal must interrupt poll() so the loop sees g_running */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int ret = relay_run(&r);
+    relay_stats(&r);
+    while (r.count) free(heap_pop(&r));
+    free(r.heap);
+    if (r.up_fd >= 0) close(r.up_fd);
+    close(r.listen_fd);
+    return ret < 0 ? 1 : 0;
+}